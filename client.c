@@ -1,14 +1,23 @@
 // client.c - Mini Cloud Storage Client (C, POSIX, Ubuntu/WSL)
 // Build: make
-// Run:   ./client <server_ip> <port>
+// Run:   ./client [-j N] [-z] <server_ip> <port>
+//        -j N moves files of 8 MiB and more over N parallel connections
+//        -z compresses upload/download bodies (LZ4) if the server supports it
 // Example: ./client 127.0.0.1 8080
 //
 // Commands at prompt:
-//   list
-//   upload <localpath> [remote_name]
-//   download <remote_name> [save_as]
+//   list [prefix]
+//   upload <localpath> [remote_name]   large files resume after a dropped
+//                                      connection (upload session); skipped
+//                                      if the server already has the content
+//   download <remote_name> [save_as]   resumes a leftover <save_as>.part and
+//                                       reconnects if the transfer drops;
+//                                       checked against the server's CRC32C
+//   stat <remote_name>                 size, mtime and checksum
 //   rename <oldname> <newname>
 //   delete <remote_name>
+//   batch <command_file>   run the commands in the file (one per line),
+//                          pipelining them instead of waiting per reply
 //   quit
 
 #define _GNU_SOURCE
@@ -16,24 +25,57 @@
 #include <errno.h>
 #include <fcntl.h>
 #include <netinet/in.h>
+#include <pthread.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdarg.h>
 #include <string.h>
+#include <sys/mman.h>
 #include <sys/socket.h>
 #include <sys/stat.h>
 #include <sys/types.h>
+#include <time.h>
 #include <unistd.h>
 
+#include "crc32c.h"
+#include "lz4.h"
+
 #define MAX_LINE 4096
 #define BUF_SIZE (1<<16)
+#define PIPELINE_DEPTH 64
+#define LIST_PAGE 1000
+#define PIPELINE_BYTES (32 * 1024)
+#define CONN_LOST (-2)   // reply helpers: the server connection is gone
+#define STALE_PART (-3)  // download_reply: the resumed prefix doesn't match the object
+#define TRANSFER_RETRIES 5      // reconnects per download / session upload
+#define SESSION_MIN (8LL << 20) // uploads this big use a resumable session; -j starts here too
+#define PART_SIZE (8LL << 20)
+#define MAX_STREAMS 64
+#define DELTA_MIN (1LL << 20)   // smaller changed files are simply sent again
+
+static int streams = 1;         // -j N: connections per large upload/download
+static bool lz4_wire;           // -z, and the server offers lz4: compress bodies
+
+// CRC32C of the first `len` bytes of fd.
+static int file_crc(int fd, long long len, uint32_t *crc, char *buf) {
+    *crc = 0;
+    for (long long off = 0; off < len; ) {
+        size_t want = (len - off > BUF_SIZE) ? BUF_SIZE : (size_t)(len - off);
+        ssize_t n = pread(fd, buf, want, (off_t)off);
+        if (n <= 0) return -1;
+        *crc = crc32c(*crc, buf, (size_t)n);
+        off += n;
+    }
+    return 0;
+}
 
 static ssize_t send_all(int fd, const void *buf, size_t len) {
     const char *p = (const char *)buf;
     size_t sent = 0;
     while (sent < len) {
-        ssize_t n = send(fd, p + sent, len - sent, 0);
+        ssize_t n = send(fd, p + sent, len - sent, MSG_NOSIGNAL);
         if (n < 0) {
             if (errno == EINTR) continue;
             return -1;
@@ -44,11 +86,52 @@ static ssize_t send_all(int fd, const void *buf, size_t len) {
     return (ssize_t)sent;
 }
 
-static ssize_t recv_all(int fd, void *buf, size_t len) {
+// Buffered reader: one recv() pulls in as much as fits, reply lines are parsed
+// out of memory, and body bytes that arrive behind a reply line are kept for
+// the next recv_all() instead of being lost.
+typedef struct {
+    char data[BUF_SIZE];
+    size_t head, tail;          // unread bytes are data[head..tail)
+} rbuf_t;
+
+typedef struct {
+    int fd;
+    rbuf_t in;
+    struct sockaddr_in addr;    // server, kept for reconnects
+} conn_t;
+
+static size_t rbuf_len(const rbuf_t *rb) {
+    return rb->tail - rb->head;
+}
+
+static void rbuf_consume(rbuf_t *rb, size_t n) {
+    rb->head += n;
+    if (rb->head == rb->tail) rb->head = rb->tail = 0;
+}
+
+static ssize_t rbuf_fill(rbuf_t *rb, int fd) {
+    if (rb->tail == BUF_SIZE && rb->head > 0) {
+        memmove(rb->data, rb->data + rb->head, rbuf_len(rb));
+        rb->tail -= rb->head;
+        rb->head = 0;
+    }
+    for (;;) {
+        ssize_t n = recv(fd, rb->data + rb->tail, BUF_SIZE - rb->tail, 0);
+        if (n < 0 && errno == EINTR) continue;
+        if (n > 0) rb->tail += (size_t)n;
+        return n;
+    }
+}
+
+// Buffered bytes first, then straight from the socket.
+static ssize_t recv_all(conn_t *c, void *buf, size_t len) {
     char *p = (char *)buf;
-    size_t recvd = 0;
+    size_t recvd = rbuf_len(&c->in);
+    if (recvd > len) recvd = len;
+    memcpy(p, c->in.data + c->in.head, recvd);
+    rbuf_consume(&c->in, recvd);
     while (recvd < len) {
-        ssize_t n = recv(fd, p + recvd, len - recvd, 0);
+        ssize_t n = recv(c->fd, p + recvd, len - recvd, 0);
         if (n < 0) {
             if (errno == EINTR) continue;
             return -1;
@@ -59,18 +142,59 @@ static ssize_t recv_all(int fd, void *buf, size_t len) {
     return (ssize_t)recvd;
 }
 
-static ssize_t recv_line(int fd, char *out, size_t cap) {
-    size_t i = 0;
-    while (i + 1 < cap) {
-        char c;
-        ssize_t n = recv(fd, &c, 1, 0);
-        if (n < 0) { if (errno == EINTR) continue; return -1; }
-        if (n == 0) { if (i == 0) return 0; break; }
-        out[i++] = c;
-        if (c == '\n') break;
+// n (at most ZBLOCK) body bytes, as one LZ4 frame when zbuf is set.
+static ssize_t send_body(conn_t *c, const void *buf, size_t n, uint8_t *zbuf) {
+    if (!zbuf) return send_all(c->fd, buf, n);
+    size_t len = zframe_pack(buf, n, zbuf);
+    return (send_all(c->fd, zbuf, len) == (ssize_t)len) ? (ssize_t)n : -1;
+}
+
+// The next n body bytes; with zbuf, from one LZ4 frame that must hold exactly
+// n (the server frames downloads in ZBLOCK steps, as the callers read them).
+static ssize_t recv_body(conn_t *c, void *buf, size_t n, uint8_t *zbuf) {
+    if (!zbuf) return recv_all(c, buf, n);
+    uint32_t hdr[2];
+    if (recv_all(c, hdr, 8) != 8) return -1;
+    uint32_t raw = ntohl(hdr[0]), stored = ntohl(hdr[1]);
+    if (raw != n || stored > ZBOUND(raw)) return -1;
+    if (recv_all(c, zbuf, stored) != (ssize_t)stored) return -1;
+    if (stored == raw) {
+        memcpy(buf, zbuf, raw);
+        return (ssize_t)raw;
+    }
+    return (lz4_decompress(zbuf, stored, (uint8_t *)buf, n) == (long)raw) ? (ssize_t)raw : -1;
+}
+
+// BUF_SIZE bytes for a body loop, plus the frame buffer for send_body() /
+// recv_body() behind it when the body is compressed (*zbuf NULL otherwise).
+static char *body_buf(bool z, uint8_t **zbuf) {
+    char *buf = (char *)malloc(BUF_SIZE + (z ? ZFRAME_MAX : 0));
+    *zbuf = (buf && z) ? (uint8_t *)buf + BUF_SIZE : NULL;
+    return buf;
+}
+
+// A DOWNLOAD reply "OK <n> <crc|-> lz4": the body comes as LZ4 frames.
+static bool reply_lz4(const char *line) {
+    size_t n = strlen(line);
+    return n > 4 && strcmp(line + n - 4, " lz4") == 0;
+}
+
+static ssize_t recv_line(conn_t *c, char *out, size_t cap) {
+    for (;;) {
+        const char *start = c->in.data + c->in.head;
+        const char *nl = (const char *)memchr(start, '\n', rbuf_len(&c->in));
+        if (nl) {
+            size_t len = (size_t)(nl - start) + 1;
+            size_t n = (len < cap) ? len : cap - 1;
+            memcpy(out, start, n);
+            out[n] = '\0';
+            rbuf_consume(&c->in, len);
+            return (ssize_t)n;
+        }
+        if (rbuf_len(&c->in) == BUF_SIZE) return -1; // no newline in a full buffer
+        ssize_t n = rbuf_fill(&c->in, c->fd);
+        if (n <= 0) return n;
     }
-    out[i] = '\0';
-    return (ssize_t)i;
 }
 
 static void chomp(char *s) {
@@ -96,32 +220,478 @@ static const char *basename2(const char *path) {
     return slash1 ? slash1 + 1 : path;
 }
 
-static int do_list(int sfd) {
-    if (send_line(sfd, "LIST\n") < 0) { perror("send"); return -1; }
+// Prints the FILE lines of one LIST page. `next` receives the continuation
+// name from a "NEXT <name>" trailer, or "" at END. Returns the page's count.
+static int list_reply(conn_t *c, char *next, size_t next_cap) {
     char line[MAX_LINE];
-    if (recv_line(sfd, line, sizeof(line)) <= 0) { fprintf(stderr, "server closed\n"); return -1; }
+    if (recv_line(c, line, sizeof(line)) <= 0) { fprintf(stderr, "server closed\n"); return CONN_LOST; }
     chomp(line);
     if (strncmp(line, "OK ", 3) != 0) { fprintf(stderr, "%s\n", line); return -1; }
     int count = 0;
     sscanf(line, "OK %d", &count);
-    printf("Files (%d):\n", count);
+    next[0] = '\0';
     for (;;) {
-        if (recv_line(sfd, line, sizeof(line)) <= 0) { fprintf(stderr, "server closed\n"); return -1; }
+        if (recv_line(c, line, sizeof(line)) <= 0) { fprintf(stderr, "server closed\n"); return CONN_LOST; }
         chomp(line);
         if (strcmp(line, "END") == 0) break;
+        if (strncmp(line, "NEXT ", 5) == 0) {
+            snprintf(next, next_cap, "%s", line + 5);
+            break;
+        }
         if (strncmp(line, "FILE ", 5) == 0) {
-            char name[1024]; long long sz = 0;
-            if (sscanf(line, "FILE %1023s %lld", name, &sz) == 2) {
-                printf("  %-30s %lld bytes\n", name, sz);
+            char name[1024], crc[16] = ""; long long sz = 0;
+            if (sscanf(line, "FILE %1023s %lld %15s", name, &sz, crc) >= 2) {
+                if (crc[0]) printf("  %-30s %lld bytes  crc32c %s\n", name, sz, crc);
+                else printf("  %-30s %lld bytes\n", name, sz);
             }
         } else {
             printf("%s\n", line);
         }
     }
+    return count;
+}
+
+// Walks the listing LIST_PAGE names at a time, following NEXT tokens.
+static int do_list(conn_t *c, const char *prefix) {
+    char after[MAX_LINE] = "-", next[MAX_LINE];
+    int total = 0;
+    printf("Files:\n");
+    for (;;) {
+        if (send_line(c->fd, "LIST %s %s %d\n", prefix ? prefix : "-", after, LIST_PAGE) < 0) {
+            perror("send");
+            return -1;
+        }
+        int r = list_reply(c, next, sizeof(next));
+        if (r < 0) return r;
+        total += r;
+        if (!next[0]) break;
+        snprintf(after, sizeof(after), "%s", next);
+    }
+    printf("(%d files)\n", total);
+    return 0;
+}
+
+// Reconnect after a dropped connection; replies still in flight are lost.
+static int conn_reconnect(conn_t *c) {
+    if (c->fd >= 0) close(c->fd);
+    c->in.head = c->in.tail = 0;
+    c->fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (c->fd < 0) return -1;
+    if (connect(c->fd, (struct sockaddr *)&c->addr, sizeof(c->addr)) < 0) return -1;
+    char line[MAX_LINE];
+    if (recv_line(c, line, sizeof(line)) <= 0 || strncmp(line, "ERR", 3) == 0) return -1;
+    return 0;
+}
+
+// One UPLOAD_PART of up to PART_SIZE bytes from *off (not past end); advances
+// *off to the end the server reports received.
+static int session_part(conn_t *c, int fd, const char *id, long long *off, long long end) {
+    char line[MAX_LINE];
+    long long len = (end - *off > PART_SIZE) ? PART_SIZE : end - *off;
+    if (send_line(c->fd, "UPLOAD_PART %s %lld %lld%s\n", id, *off, len, lz4_wire ? " lz4" : "") < 0) return CONN_LOST;
+    if (recv_line(c, line, sizeof(line)) <= 0) return CONN_LOST;
+    chomp(line);
+    // Busy: the server still holds our previous, half-dead connection; back
+    // off and retry like after a drop.
+    if (strcmp(line, "ERR session busy") == 0) return CONN_LOST;
+    if (strcmp(line, "OK") != 0) { fprintf(stderr, "%s\n", line); return -1; }
+
+    uint8_t *zbuf;
+    char *buf = body_buf(lz4_wire, &zbuf);
+    if (!buf) { fprintf(stderr, "oom\n"); return -1; }
+    long long done = 0;
+    while (done < len) {
+        size_t chunk = (len - done > BUF_SIZE) ? BUF_SIZE : (size_t)(len - done);
+        ssize_t n = pread(fd, buf, chunk, (off_t)(*off + done));
+        if (n <= 0) { perror("read"); free(buf); return -1; }
+        if (send_body(c, buf, (size_t)n, zbuf) != n) { free(buf); return CONN_LOST; }
+        done += n;
+    }
+    free(buf);
+    if (recv_line(c, line, sizeof(line)) <= 0) return CONN_LOST;
+    chomp(line);
+    if (sscanf(line, "OK RECEIVED %lld", off) != 1) { fprintf(stderr, "%s\n", line); return -1; }
+    return 0;
+}
+
+// One connection's share of a parallel transfer: bytes [off, end) of the
+// local file fd, moved with its own connection and reconnects.
+typedef struct {
+    const struct sockaddr_in *addr;
+    const char *name;           // session id (upload) or object name (download)
+    int fd;
+    long long off, end;         // off advances as bytes are confirmed
+    int rc;
+} range_job_t;
+
+// Uploads the range as session parts.
+static int range_upload(conn_t *c, range_job_t *job) {
+    int r = 0;
+    while (r == 0 && job->off < job->end) r = session_part(c, job->fd, job->name, &job->off, job->end);
+    return r;
+}
+
+// Downloads the range with DOWNLOAD <name> <offset> <length>, writing it in
+// place with pwrite().
+static int range_download(conn_t *c, range_job_t *job) {
+    char line[MAX_LINE];
+    if (send_line(c->fd, "DOWNLOAD %s %lld %lld%s\n", job->name, job->off, job->end - job->off,
+                  lz4_wire ? " lz4" : "") < 0) return CONN_LOST;
+    if (recv_line(c, line, sizeof(line)) <= 0) return CONN_LOST;
+    chomp(line);
+    long long len;
+    if (sscanf(line, "OK %lld", &len) != 1 || len != job->end - job->off) { fprintf(stderr, "%s\n", line); return -1; }
+    uint8_t *zbuf;
+    char *buf = body_buf(reply_lz4(line), &zbuf);
+    if (!buf) { fprintf(stderr, "oom\n"); return -1; }
+    int r = 0;
+    while (r == 0 && job->off < job->end) {
+        size_t chunk = (job->end - job->off > BUF_SIZE) ? BUF_SIZE : (size_t)(job->end - job->off);
+        ssize_t n = recv_body(c, buf, chunk, zbuf);
+        if (n > 0 && pwrite(job->fd, buf, (size_t)n, (off_t)job->off) != n) { perror("write"); r = -1; break; }
+        if (n > 0) job->off += n;
+        if (n < (ssize_t)chunk) r = CONN_LOST;
+    }
+    free(buf);
+    return r;
+}
+
+static void *range_thread(void *arg, int (*move)(conn_t *, range_job_t *)) {
+    range_job_t *job = (range_job_t *)arg;
+    conn_t *c = (conn_t *)calloc(1, sizeof(conn_t));
+    if (!c) { job->rc = -1; return NULL; }
+    c->fd = -1;
+    c->addr = *job->addr;
+    int r = CONN_LOST;
+    for (int attempt = 0; attempt <= TRANSFER_RETRIES; attempt++) {
+        if (attempt > 0) sleep((unsigned)attempt);
+        if (conn_reconnect(c) < 0) continue;
+        r = move(c, job);
+        if (r != CONN_LOST) break;
+    }
+    if (c->fd >= 0) close(c->fd);
+    free(c);
+    job->rc = r;
+    return NULL;
+}
+
+static void *range_upload_thread(void *arg) { return range_thread(arg, range_upload); }
+static void *range_download_thread(void *arg) { return range_thread(arg, range_download); }
+
+// Splits [lo, hi) into `streams` ranges moved concurrently by fn. Returns 0
+// when all succeeded; *done (if set) receives the end of the contiguous prefix
+// that made it.
+static int run_ranges(conn_t *c, const char *name, int fd, long long lo, long long hi,
+                      void *(*fn)(void *), long long *done) {
+    range_job_t jobs[MAX_STREAMS];
+    pthread_t th[MAX_STREAMS];
+    int n = streams;
+    if (done) *done = lo;
+    if (lo >= hi) return 0;
+    long long step = (hi - lo + n - 1) / n;
+    step = (step + BUF_SIZE - 1) / BUF_SIZE * BUF_SIZE;
+    int started = 0;
+    for (int i = 0; i < n && lo + i * step < hi; i++) {
+        range_job_t *j = &jobs[i];
+        j->addr = &c->addr;
+        j->name = name;
+        j->fd = fd;
+        j->off = lo + i * step;
+        j->end = (j->off + step < hi) ? j->off + step : hi;
+        j->rc = -1;
+        if (pthread_create(&th[i], NULL, fn, j) != 0) break;
+        started++;
+    }
+    int rc = (started > 0 && lo + started * step >= hi) ? 0 : -1;
+    long long prefix = lo;
+    bool gap = false;
+    for (int i = 0; i < started; i++) {
+        pthread_join(th[i], NULL);
+        if (jobs[i].rc != 0) rc = -1;
+        if (!gap) {
+            prefix = jobs[i].off;
+            gap = jobs[i].off < jobs[i].end;
+        }
+    }
+    if (done) *done = prefix;
+    return rc;
+}
+
+// Large files go up in parts of an upload session; after a dropped connection
+// the client reconnects, asks how much arrived (UPLOAD_STATUS) and continues
+// from there, so only the missing bytes are sent again. With -j N the parts
+// go over N connections at once.
+static int upload_session(conn_t *c, int fd, const char *remote, long long size, uint32_t crc) {
+    char line[MAX_LINE], id[64];
+    if (send_line(c->fd, "UPLOAD_BEGIN %s %lld\n", remote, size) < 0) { perror("send"); return -1; }
+    if (recv_line(c, line, sizeof(line)) <= 0) { fprintf(stderr, "server closed\n"); return -1; }
+    chomp(line);
+    if (sscanf(line, "OK %63s", id) != 1) { fprintf(stderr, "%s\n", line); return -1; }
+
+    long long off = 0;
+    if (streams > 1) {
+        // Parts arrive out of order, so UPLOAD_STATUS can't resume this one:
+        // each stream retries its own range instead.
+        if (run_ranges(c, id, fd, 0, size, range_upload_thread, NULL) < 0) {
+            fprintf(stderr, "parallel upload failed\n");
+            // Don't leave the partial session behind (c sat idle meanwhile).
+            if (send_line(c->fd, "UPLOAD_ABORT %s\n", id) >= 0) recv_line(c, line, sizeof(line));
+            return -1;
+        }
+        off = size;
+    }
+    for (int attempt = 1;; attempt++) {
+        int r = 0;
+        while (r == 0 && off < size) r = session_part(c, fd, id, &off, size);
+        if (r == 0) {
+            if (send_line(c->fd, "UPLOAD_COMMIT %s %08x\n", id, crc) < 0 || recv_line(c, line, sizeof(line)) <= 0) {
+                r = CONN_LOST;
+            } else {
+                chomp(line);
+                if (strncmp(line, "OK", 2) == 0) return 0;
+                fprintf(stderr, "%s\n", line);
+                return -1;
+            }
+        }
+        if (r != CONN_LOST) return r;
+        if (attempt > TRANSFER_RETRIES) { fprintf(stderr, "server closed\n"); return -1; }
+        sleep((unsigned)attempt);
+        if (conn_reconnect(c) < 0) { fprintf(stderr, "reconnect failed\n"); continue; }
+        if (send_line(c->fd, "UPLOAD_STATUS %s\n", id) < 0 || recv_line(c, line, sizeof(line)) <= 0) continue;
+        chomp(line);
+        if (sscanf(line, "OK %lld", &off) != 1) { fprintf(stderr, "%s\n", line); return -1; }
+        fprintf(stderr, "reconnected, resuming %s at %lld\n", remote, off);
+    }
+}
+
+// Asks the server whether `remote` already holds this content (HAVE with the
+// local size and CRC32C). 1: it does, 0: upload it, <0: error.
+static int remote_have(conn_t *c, const char *remote, long long size, uint32_t crc) {
+    char line[MAX_LINE];
+    if (send_line(c->fd, "HAVE %s %lld %08x\n", remote, size, crc) < 0) { perror("send"); return -1; }
+    if (recv_line(c, line, sizeof(line)) <= 0) { fprintf(stderr, "server closed\n"); return -1; }
+    return strncmp(line, "OK HAVE", 7) == 0;  // an older server answers ERR: just upload
+}
+
+// Delta upload, rsync style: SIGNATURE gives the weak rolling checksum and
+// CRC32C of each block of the server's version; every block found anywhere in
+// the local file is rebuilt on the server with UPLOAD_COPY, and only the bytes
+// in between travel as UPLOAD_PARTs. UPLOAD_COMMIT carries the whole-file
+// CRC32C, so a false block match is refused rather than published.
+typedef struct {
+    long long dst, src, len;
+} copy_op_t;
+
+typedef struct {
+    long long block;
+    long long n;                // blocks, the last one may be short
+    long long tail;             // length of the last block
+    uint32_t *weak, *strong;
+    uint32_t *table;            // open addressing on weak: block index + 1
+    size_t mask;
+} signature_t;
+
+static void signature_free(signature_t *sg) {
+    free(sg->weak);
+    free(sg->strong);
+    free(sg->table);
+}
+
+// rsync's rolling checksum, as on the server.
+static uint32_t weak_sum(const uint8_t *p, size_t n, uint32_t *a_out, uint32_t *b_out) {
+    uint32_t a = 0, b = 0;
+    for (size_t i = 0; i < n; i++) {
+        a += p[i];
+        b += (uint32_t)(n - i) * p[i];
+    }
+    *a_out = a;
+    *b_out = b;
+    return (a & 0xffff) | (b << 16);
+}
+
+static size_t weak_slot(uint32_t w, size_t mask) {
+    return (size_t)((w * 2654435761u) >> 7) & mask;
+}
+
+// Reads the SIGNATURE reply into sg. 0 on success, -1 if the server has no
+// usable old version, CONN_LOST.
+static int signature_fetch(conn_t *c, const char *remote, signature_t *sg) {
+    char line[MAX_LINE];
+    long long size;
+    memset(sg, 0, sizeof(*sg));
+    if (send_line(c->fd, "SIGNATURE %s\n", remote) < 0) return CONN_LOST;
+    if (recv_line(c, line, sizeof(line)) <= 0) return CONN_LOST;
+    if (sscanf(line, "OK %lld %lld %lld", &size, &sg->block, &sg->n) != 3) return -1;
+    bool ok = sg->block > 0 && sg->n > 0 && sg->n == (size + sg->block - 1) / sg->block;
+    size_t cap = 2;
+    while (ok && cap < 2 * (size_t)sg->n) cap *= 2;
+    sg->weak = (uint32_t *)malloc(sizeof(uint32_t) * (size_t)(ok ? sg->n : 1));
+    sg->strong = (uint32_t *)malloc(sizeof(uint32_t) * (size_t)(ok ? sg->n : 1));
+    sg->table = (uint32_t *)calloc(cap, sizeof(uint32_t));
+    sg->mask = cap - 1;
+    if (!sg->weak || !sg->strong || !sg->table) ok = false;
+    // Always drain the block lines to keep the connection in step.
+    for (long long i = 0; i < sg->n; i++) {
+        if (recv_line(c, line, sizeof(line)) <= 0) { signature_free(sg); return CONN_LOST; }
+        if (ok && sscanf(line, "%8x%8x", &sg->weak[i], &sg->strong[i]) != 2) ok = false;
+    }
+    if (!ok) { signature_free(sg); return -1; }
+    sg->tail = size - (sg->n - 1) * sg->block;
+    for (long long i = 0; i < sg->n - (sg->tail < sg->block); i++) {
+        size_t h = weak_slot(sg->weak[i], sg->mask);
+        while (sg->table[h]) h = (h + 1) & sg->mask;
+        sg->table[h] = (uint32_t)(i + 1);
+    }
+    return 0;
+}
+
+// Block of the old version whose content is p[0, block), or -1. `hint` (the
+// block after the previous match) is tried first so runs stay contiguous.
+static long long signature_find(const signature_t *sg, const uint8_t *p, uint32_t w, long long hint) {
+    bool have_crc = false;
+    uint32_t crc = 0;
+    if (hint >= 0 && hint < sg->n && (hint < sg->n - 1 || sg->tail == sg->block) && sg->weak[hint] == w) {
+        crc = crc32c(0, p, (size_t)sg->block);
+        have_crc = true;
+        if (sg->strong[hint] == crc) return hint;
+    }
+    for (size_t h = weak_slot(w, sg->mask); sg->table[h]; h = (h + 1) & sg->mask) {
+        long long i = sg->table[h] - 1;
+        if (sg->weak[i] != w) continue;
+        if (!have_crc) {
+            crc = crc32c(0, p, (size_t)sg->block);
+            have_crc = true;
+        }
+        if (sg->strong[i] == crc) return i;
+    }
+    return -1;
+}
+
+static bool copy_add(copy_op_t **ops, size_t *n, size_t *cap, long long dst, long long src, long long len) {
+    if (*n && (*ops)[*n - 1].dst + (*ops)[*n - 1].len == dst && (*ops)[*n - 1].src + (*ops)[*n - 1].len == src) {
+        (*ops)[*n - 1].len += len;
+        return true;
+    }
+    if (*n == *cap) {
+        size_t nc = *cap ? *cap * 2 : 64;
+        copy_op_t *p = (copy_op_t *)realloc(*ops, nc * sizeof(copy_op_t));
+        if (!p) return false;
+        *ops = p;
+        *cap = nc;
+    }
+    (*ops)[(*n)++] = (copy_op_t){ dst, src, len };
+    return true;
+}
+
+// Slides a block-sized window over p[0, size), rolling the weak checksum one
+// byte at a time and jumping a whole block on each match. Returns the copy
+// ops (coalesced runs), NULL if nothing matched.
+static copy_op_t *delta_match(const signature_t *sg, const uint8_t *p, long long size, size_t *nops) {
+    copy_op_t *ops = NULL;
+    size_t n = 0, cap = 0;
+    long long B = sg->block, i = 0, hint = -1;
+    uint32_t a = 0, b = 0, w = 0;
+    if (size >= B) w = weak_sum(p, (size_t)B, &a, &b);
+    while (i + B <= size) {
+        long long j = signature_find(sg, p + i, w, hint);
+        if (j >= 0) {
+            if (!copy_add(&ops, &n, &cap, i, j * B, B)) break;
+            i += B;
+            hint = j + 1;
+            if (i + B <= size) w = weak_sum(p + i, (size_t)B, &a, &b);
+            continue;
+        }
+        if (i + B == size) break;
+        uint32_t out = p[i], in = p[i + B];
+        a = a - out + in;
+        b = b - (uint32_t)B * out + a;
+        w = (a & 0xffff) | (b << 16);
+        i++;
+    }
+    // A short last block can only line up with the end of the file.
+    long long t = sg->tail;
+    if (t < B && size >= t && size - t >= i) {
+        uint32_t ta, tb;
+        if (sg->weak[sg->n - 1] == weak_sum(p + size - t, (size_t)t, &ta, &tb) &&
+            sg->strong[sg->n - 1] == crc32c(0, p + size - t, (size_t)t)) {
+            copy_add(&ops, &n, &cap, size - t, (sg->n - 1) * B, t);
+        }
+    }
+    *nops = n;
+    if (n == 0) { free(ops); return NULL; }
+    return ops;
+}
+
+// Sends the copy ops PIPELINE_DEPTH at a time.
+static int delta_copy(conn_t *c, const char *id, const copy_op_t *ops, size_t n) {
+    char line[MAX_LINE];
+    for (size_t i = 0; i < n; ) {
+        size_t k = 0;
+        for (; k < PIPELINE_DEPTH && i + k < n; k++) {
+            const copy_op_t *op = &ops[i + k];
+            if (send_line(c->fd, "UPLOAD_COPY %s %lld %lld %lld\n", id, op->dst, op->len, op->src) < 0) return CONN_LOST;
+        }
+        int r = 0;
+        for (size_t j = 0; j < k; j++) {
+            if (recv_line(c, line, sizeof(line)) <= 0) return CONN_LOST;
+            chomp(line);
+            if (strncmp(line, "OK RECEIVED", 11) != 0 && r == 0) { fprintf(stderr, "%s\n", line); r = -1; }
+        }
+        if (r < 0) return r;
+        i += k;
+    }
     return 0;
 }
 
-static int do_upload(int sfd, const char *local, const char *remote_opt) {
+// 0 when uploaded, 1 when a delta doesn't apply (no old version, nothing in
+// common, or the result failed its checksum) and the file should be sent
+// whole, <0 on error.
+static int upload_delta(conn_t *c, int fd, const char *remote, long long size, uint32_t crc) {
+    char line[MAX_LINE], id[64];
+    signature_t sg;
+    int r = signature_fetch(c, remote, &sg);
+    if (r == CONN_LOST) { fprintf(stderr, "server closed\n"); return -1; }
+    if (r < 0) return 1;
+    const uint8_t *p = (const uint8_t *)mmap(NULL, (size_t)size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (p == MAP_FAILED) { signature_free(&sg); return 1; }
+    size_t nops;
+    copy_op_t *ops = delta_match(&sg, p, size, &nops);
+    munmap((void *)p, (size_t)size);
+    signature_free(&sg);
+    if (!ops) return 1;
+
+    if (send_line(c->fd, "UPLOAD_BEGIN %s %lld\n", remote, size) < 0 || recv_line(c, line, sizeof(line)) <= 0) {
+        free(ops); fprintf(stderr, "server closed\n"); return -1;
+    }
+    chomp(line);
+    if (sscanf(line, "OK %63s", id) != 1) { free(ops); fprintf(stderr, "%s\n", line); return -1; }
+    r = delta_copy(c, id, ops, nops);
+    long long pos = 0, literal = 0;
+    for (size_t i = 0; r == 0 && i <= nops; i++) {
+        long long end = (i < nops) ? ops[i].dst : size;
+        literal += end - pos;
+        while (r == 0 && pos < end) r = session_part(c, fd, id, &pos, end);
+        if (i < nops) pos = ops[i].dst + ops[i].len;
+    }
+    free(ops);
+    if (r == 0) {
+        if (send_line(c->fd, "UPLOAD_COMMIT %s %08x\n", id, crc) < 0 || recv_line(c, line, sizeof(line)) <= 0) {
+            r = CONN_LOST;
+        } else {
+            chomp(line);
+            if (strcmp(line, "ERR checksum mismatch") == 0) return 1;
+            if (strncmp(line, "OK", 2) != 0) { fprintf(stderr, "%s\n", line); return -1; }
+            printf("Upload complete: %s (%lld bytes, %lld sent as delta)\n", remote, size, literal);
+            return 0;
+        }
+    }
+    if (r == CONN_LOST) { fprintf(stderr, "server closed\n"); return -1; }
+    // Don't leave the half-built session behind.
+    if (send_line(c->fd, "UPLOAD_ABORT %s\n", id) >= 0) recv_line(c, line, sizeof(line));
+    return -1;
+}
+
+static int do_upload(conn_t *c, const char *local, const char *remote_opt) {
     const char *remote = remote_opt ? remote_opt : basename2(local);
     // get size
     struct stat st;
@@ -133,19 +703,46 @@ static int do_upload(int sfd, const char *local, const char *remote_opt) {
     int fd = open(local, O_RDONLY);
     if (fd < 0) { perror("open"); return -1; }
 
-    if (send_line(sfd, "UPLOAD %s %lld\n", remote, size) < 0) { perror("send"); close(fd); return -1; }
+    char *buf = malloc(BUF_SIZE);
+    uint32_t crc;
+    if (!buf) { fprintf(stderr, "oom\n"); close(fd); return -1; }
+    if (file_crc(fd, size, &crc, buf) < 0) { perror("read"); free(buf); close(fd); return -1; }
+    free(buf);
+    int have = remote_have(c, remote, size, crc);
+    if (have != 0) {
+        close(fd);
+        if (have < 0) return -1;
+        printf("Unchanged: %s (%lld bytes), upload skipped\n", remote, size);
+        return 0;
+    }
+    if (size >= DELTA_MIN) {
+        int r = upload_delta(c, fd, remote, size, crc);
+        if (r <= 0) { close(fd); return r; }
+    }
+
+    if (size >= SESSION_MIN) {
+        int r = upload_session(c, fd, remote, size, crc);
+        close(fd);
+        if (r == 0) printf("Upload complete: %s (%lld bytes)\n", remote, size);
+        return r;
+    }
+
+    if (send_line(c->fd, "UPLOAD %s %lld %08x%s\n", remote, size, crc, lz4_wire ? " lz4" : "") < 0) {
+        perror("send"); close(fd); return -1;
+    }
 
     char line[MAX_LINE];
-    if (recv_line(sfd, line, sizeof(line)) <= 0) { fprintf(stderr, "server closed\n"); close(fd); return -1; }
+    if (recv_line(c, line, sizeof(line)) <= 0) { fprintf(stderr, "server closed\n"); close(fd); return -1; }
     chomp(line);
     if (strcmp(line, "OK") != 0) { fprintf(stderr, "%s\n", line); close(fd); return -1; }
 
-    char *buf = malloc(BUF_SIZE);
+    uint8_t *zbuf;
+    buf = body_buf(lz4_wire, &zbuf);
     if (!buf) { fprintf(stderr, "oom\n"); close(fd); return -1; }
     ssize_t n;
     long long sent = 0;
     while ((n = read(fd, buf, BUF_SIZE)) > 0) {
-        if (send_all(sfd, buf, (size_t)n) != n) {
+        if (send_body(c, buf, (size_t)n, zbuf) != n) {
             perror("send data");
             free(buf); close(fd); return -1;
         }
@@ -158,7 +755,7 @@ static int do_upload(int sfd, const char *local, const char *remote_opt) {
         fprintf(stderr, "Upload mismatch: sent %lld of %lld\n", sent, size);
         return -1;
     }
-    if (recv_line(sfd, line, sizeof(line)) <= 0) { fprintf(stderr, "server closed\n"); return -1; }
+    if (recv_line(c, line, sizeof(line)) <= 0) { fprintf(stderr, "server closed\n"); return -1; }
     chomp(line);
     if (strncmp(line, "OK", 2) == 0) {
         printf("Upload complete: %s (%lld bytes)\n", remote, size);
@@ -169,67 +766,368 @@ static int do_upload(int sfd, const char *local, const char *remote_opt) {
     }
 }
 
-static int do_download(int sfd, const char *remote, const char *save_as_opt) {
-    if (send_line(sfd, "DOWNLOAD %s\n", remote) < 0) { perror("send"); return -1; }
+// Receives into "<save_as>.part" starting at `offset` (the bytes before it are
+// already there) and renames it into place once complete. A dropped connection
+// (CONN_LOST) or a local error (-1) leaves the .part file behind for
+// do_download() to resume; STALE_PART means it can't be resumed.
+static int download_reply(conn_t *c, const char *remote, const char *save_as_opt, long long offset) {
     char line[MAX_LINE];
-    if (recv_line(sfd, line, sizeof(line)) <= 0) { fprintf(stderr, "server closed\n"); return -1; }
+    if (recv_line(c, line, sizeof(line)) <= 0) { fprintf(stderr, "server closed\n"); return CONN_LOST; }
     chomp(line);
-    if (strncmp(line, "OK ", 3) != 0) { fprintf(stderr, "%s\n", line); return -1; }
+    if (strncmp(line, "OK ", 3) != 0) {
+        fprintf(stderr, "%s\n", line);
+        return strcmp(line, "ERR bad range") == 0 ? STALE_PART : -1;
+    }
     long long size = 0;
-    sscanf(line, "OK %lld", &size);
+    unsigned int want_crc;
+    bool check = sscanf(line, "OK %lld %x", &size, &want_crc) == 2;
 
-    const char *save_as = save_as_opt ? save_as_opt : remote;
-    int fd = open(save_as, O_WRONLY | O_CREAT | O_TRUNC, 0644);
-    if (fd < 0) { perror("open save_as"); return -1; }
+    uint8_t *zbuf;
+    char *buf = body_buf(reply_lz4(line), &zbuf);
+    if (!buf) { fprintf(stderr, "oom\n"); return CONN_LOST; } // nothing to skip the body with
 
-    char *buf = malloc(BUF_SIZE);
-    if (!buf) { fprintf(stderr, "oom\n"); close(fd); return -1; }
+    // A local failure still reads the whole body, keeping the replies in step.
+    const char *save_as = save_as_opt ? save_as_opt : remote;
+    char part[MAX_LINE];
+    snprintf(part, sizeof(part), "%s.part", save_as);
+    int fd = open(part, O_RDWR | O_CREAT | (offset ? 0 : O_TRUNC), 0644);
+    bool ok = fd >= 0;
+    if (!ok) perror("open save_as");
+    if (ok && offset && (ftruncate(fd, offset) < 0 || lseek(fd, offset, SEEK_SET) < 0)) {
+        perror("seek save_as");
+        ok = false;
+    }
+    // The checksum covers the whole object: pick up the resumed prefix first.
+    uint32_t crc = 0;
+    if (ok && check && offset && file_crc(fd, offset, &crc, buf) < 0) {
+        fprintf(stderr, "read failed\n");
+        ok = false;
+    }
 
     long long remaining = size;
     while (remaining > 0) {
         size_t chunk = (remaining > BUF_SIZE) ? BUF_SIZE : (size_t)remaining;
-        ssize_t n = recv_all(sfd, buf, chunk);
-        if (n <= 0) {
-            fprintf(stderr, "recv data failed\n");
-            free(buf); close(fd); return -1;
-        }
-        ssize_t w = write(fd, buf, (size_t)n);
-        if (w != n) {
+        ssize_t n = recv_body(c, buf, chunk, zbuf);
+        if (ok && n > 0 && write(fd, buf, (size_t)n) != n) {
             fprintf(stderr, "write failed\n");
-            free(buf); close(fd); return -1;
+            ok = false;
+        }
+        if (n > 0) remaining -= n;
+        if (n > 0 && check) crc = crc32c(crc, buf, (size_t)n);
+        if (n < (ssize_t)chunk) {
+            fprintf(stderr, "recv data failed\n");
+            free(buf);
+            if (fd >= 0) close(fd);
+            return CONN_LOST;
         }
-        remaining -= n;
     }
     free(buf);
+    if (fd >= 0) close(fd);
+    if (!ok) return -1;
+    if (check && crc != want_crc) {
+        fprintf(stderr, "checksum mismatch for %s (got %08x, expected %08x)\n", remote, crc, want_crc);
+        unlink(part);
+        return STALE_PART;
+    }
+    if (rename(part, save_as) < 0) { perror("rename save_as"); return -1; }
+
+    if (offset) printf("Downloaded %s (resumed at %lld, %lld bytes) -> %s\n", remote, offset, offset + size, save_as);
+    else printf("Downloaded %s (%lld bytes) -> %s\n", remote, size, save_as);
+    return 0;
+}
+
+// Size of remote object `name` from a one-entry LIST, or -1. *crc receives its
+// checksum, or -1 if the server has none.
+static long long remote_size(conn_t *c, const char *name, long long *crc) {
+    char line[MAX_LINE], fname[1024];
+    long long size = -1, sz;
+    unsigned int x;
+    *crc = -1;
+    if (send_line(c->fd, "LIST %s - 1\n", name) < 0) return -1;
+    if (recv_line(c, line, sizeof(line)) <= 0 || strncmp(line, "OK", 2) != 0) return -1;
+    for (;;) {
+        if (recv_line(c, line, sizeof(line)) <= 0) return -1;
+        if (strncmp(line, "END", 3) == 0 || strncmp(line, "NEXT ", 5) == 0) break;
+        int got = sscanf(line, "FILE %1023s %lld %x", fname, &sz, &x);
+        if (got >= 2 && strcmp(fname, name) == 0) {
+            size = sz;
+            if (got == 3) *crc = x;
+        }
+    }
+    return size;
+}
+
+// -j N download: N ranged DOWNLOADs written in place into "<save_as>.jpart".
+// Whatever contiguous prefix arrived is kept as "<save_as>.part" on failure,
+// so a later download resumes it; a .part found here is continued the same way.
+static int download_parallel(conn_t *c, const char *remote, const char *save_as, long long size,
+                             long long want_crc) {
+    char part[MAX_LINE], jpart[MAX_LINE];
+    snprintf(part, sizeof(part), "%s.part", save_as);
+    snprintf(jpart, sizeof(jpart), "%s.jpart", save_as);
+    struct stat st;
+    long long base = 0;
+    if (stat(part, &st) == 0 && (long long)st.st_size <= size && rename(part, jpart) == 0) {
+        base = (long long)st.st_size;
+    }
+    int fd = open(jpart, O_RDWR | O_CREAT | (base ? 0 : O_TRUNC), 0644);
+    if (fd < 0 || ftruncate(fd, base) < 0) { perror("open save_as"); if (fd >= 0) close(fd); return -1; }
+
+    long long done = base;
+    int r = run_ranges(c, remote, fd, base, size, range_download_thread, &done);
+    if (r == 0 && want_crc >= 0) {
+        // Ranges land out of order: checksum the finished file in one pass.
+        uint32_t crc;
+        char *buf = malloc(BUF_SIZE);
+        if (!buf || file_crc(fd, size, &crc, buf) < 0 || crc != (uint32_t)want_crc) {
+            fprintf(stderr, "checksum mismatch for %s\n", remote);
+            free(buf);
+            close(fd);
+            unlink(jpart);
+            return -1;
+        }
+        free(buf);
+    }
     close(fd);
+    if (r < 0) {
+        if (truncate(jpart, done) == 0) rename(jpart, part);
+        fprintf(stderr, "Download of %s incomplete: %lld of %lld bytes kept in %s\n", remote, done, size, part);
+        return -1;
+    }
+    if (rename(jpart, save_as) < 0) { perror("rename save_as"); return -1; }
+    printf("Downloaded %s (%lld bytes, %d streams) -> %s\n", remote, size, streams, save_as);
+    return 0;
+}
+
+// Resumes from an existing "<save_as>.part" and, if the connection drops,
+// reconnects and asks only for the missing bytes (DOWNLOAD <name> <offset>).
+static int do_download(conn_t *c, const char *remote, const char *save_as_opt) {
+    const char *save_as = save_as_opt ? save_as_opt : remote;
+    if (streams > 1) {
+        long long crc, size = remote_size(c, remote, &crc);
+        if (size >= SESSION_MIN) return download_parallel(c, remote, save_as, size, crc);
+    }
+    char part[MAX_LINE];
+    snprintf(part, sizeof(part), "%s.part", save_as);
+    int r = -1;
+    for (int attempt = 0; attempt <= TRANSFER_RETRIES; attempt++) {
+        if (attempt > 0) {
+            sleep((unsigned)attempt);
+            if (conn_reconnect(c) < 0) { fprintf(stderr, "reconnect failed\n"); continue; }
+            fprintf(stderr, "reconnected, resuming %s\n", remote);
+        }
+        struct stat st;
+        long long offset = (stat(part, &st) == 0) ? (long long)st.st_size : 0;
+        int sent = lz4_wire ? send_line(c->fd, "DOWNLOAD %s %lld -1 lz4\n", remote, offset)
+                 : offset ? send_line(c->fd, "DOWNLOAD %s %lld\n", remote, offset)
+                          : send_line(c->fd, "DOWNLOAD %s\n", remote);
+        if (sent < 0) { perror("send"); r = CONN_LOST; continue; }
+        r = download_reply(c, remote, save_as_opt, offset);
+        if (r == STALE_PART && offset) {
+            // The remote copy shrank or changed: start over. A local error
+            // keeps the .part for a later resume.
+            unlink(part);
+            attempt--;
+            continue;
+        }
+        if (r != CONN_LOST) return r < 0 ? -1 : r;
+    }
+    return r;
+}
 
-    printf("Downloaded %s (%lld bytes) -> %s\n", remote, size, save_as);
+static int do_stat(conn_t *c, const char *name) {
+    char line[MAX_LINE], crc[16];
+    long long size, mtime;
+    if (send_line(c->fd, "STAT %s\n", name) < 0) { perror("send"); return -1; }
+    if (recv_line(c, line, sizeof(line)) <= 0) { fprintf(stderr, "server closed\n"); return CONN_LOST; }
+    chomp(line);
+    if (sscanf(line, "OK %lld %lld %15s", &size, &mtime, crc) != 3) { fprintf(stderr, "%s\n", line); return -1; }
+    time_t t = (time_t)mtime;
+    char when[64];
+    strftime(when, sizeof(when), "%Y-%m-%d %H:%M:%S", localtime(&t));
+    printf("  %s: %lld bytes, modified %s, crc32c %s\n", name, size, when, crc);
     return 0;
 }
 
-static int do_rename_remote(int sfd, const char *oldn, const char *newn) {
-    if (send_line(sfd, "RENAME %s %s\n", oldn, newn) < 0) { perror("send"); return -1; }
-    char line[MAX_LINE];
-    if (recv_line(sfd, line, sizeof(line)) <= 0) { fprintf(stderr, "server closed\n"); return -1; }
+// Kept versions of an object, oldest first; "download <name>@<id>" gets one.
+static int do_versions(conn_t *c, const char *name) {
+    char line[MAX_LINE], crc[16];
+    size_t n;
+    if (send_line(c->fd, "VERSIONS %s\n", name) < 0) { perror("send"); return -1; }
+    if (recv_line(c, line, sizeof(line)) <= 0) { fprintf(stderr, "server closed\n"); return CONN_LOST; }
     chomp(line);
-    if (strncmp(line, "OK", 2) == 0) { printf("Renamed.\n"); return 0; }
-    fprintf(stderr, "%s\n", line);
-    return -1;
+    if (sscanf(line, "OK %zu", &n) != 1) { fprintf(stderr, "%s\n", line); return -1; }
+    if (n == 0) printf("  (no versions)\n");
+    for (size_t i = 0; i < n; i++) {
+        unsigned long long id;
+        long long size, mtime;
+        if (recv_line(c, line, sizeof(line)) <= 0) { fprintf(stderr, "server closed\n"); return CONN_LOST; }
+        if (sscanf(line, "VERSION %llu %lld %lld %15s", &id, &size, &mtime, crc) != 4) continue;
+        time_t t = (time_t)mtime;
+        char when[64];
+        strftime(when, sizeof(when), "%Y-%m-%d %H:%M:%S", localtime(&t));
+        printf("  %s@%llu: %lld bytes, modified %s, crc32c %s\n", name, id, size, when, crc);
+    }
+    return 0;
 }
 
-static int do_delete_remote(int sfd, const char *name) {
-    if (send_line(sfd, "DELETE %s\n", name) < 0) { perror("send"); return -1; }
+// Single "OK ..." / "ERR ..." reply (RENAME, DELETE).
+static int ack_reply(conn_t *c, const char *done_msg) {
     char line[MAX_LINE];
-    if (recv_line(sfd, line, sizeof(line)) <= 0) { fprintf(stderr, "server closed\n"); return -1; }
+    if (recv_line(c, line, sizeof(line)) <= 0) { fprintf(stderr, "server closed\n"); return CONN_LOST; }
     chomp(line);
-    if (strncmp(line, "OK", 2) == 0) { printf("Deleted.\n"); return 0; }
+    if (strncmp(line, "OK", 2) == 0) { printf("%s\n", done_msg); return 0; }
     fprintf(stderr, "%s\n", line);
     return -1;
 }
 
+static int do_rename_remote(conn_t *c, const char *oldn, const char *newn) {
+    if (send_line(c->fd, "RENAME %s %s\n", oldn, newn) < 0) { perror("send"); return -1; }
+    return ack_reply(c, "Renamed.");
+}
+
+static int do_delete_remote(conn_t *c, const char *name) {
+    if (send_line(c->fd, "DELETE %s\n", name) < 0) { perror("send"); return -1; }
+    return ack_reply(c, "Deleted.");
+}
+
+// Batch mode pipelines requests: up to PIPELINE_DEPTH requests (and at most
+// PIPELINE_BYTES of request text, so neither side can block on a full socket
+// while the other is still sending) are in flight, sent in one write, and
+// their replies are read back in order. Uploads need the server's go-ahead
+// before the body, so they drain the pipeline and run synchronously.
+enum { OP_LIST, OP_DOWNLOAD, OP_RENAME, OP_DELETE };
+
+typedef struct {
+    int kind;
+    char a1[1024], a2[1024];
+    size_t req_len;
+} batch_op_t;
+
+typedef struct {
+    batch_op_t ops[PIPELINE_DEPTH];
+    int head, count;
+    size_t bytes;               // request bytes sent or queued, not yet answered
+    char out[PIPELINE_BYTES];   // requests not yet sent
+    size_t out_len;
+    int ok, failed;
+} pipeline_t;
+
+// Send queued requests, then consume the reply to the oldest one.
+static int pipeline_complete(conn_t *c, pipeline_t *pl) {
+    if (pl->out_len > 0) {
+        if (send_all(c->fd, pl->out, pl->out_len) != (ssize_t)pl->out_len) { perror("send"); return CONN_LOST; }
+        pl->out_len = 0;
+    }
+    batch_op_t *op = &pl->ops[pl->head];
+    int r;
+    switch (op->kind) {
+    case OP_LIST: {
+        char next[MAX_LINE];
+        printf("Files:\n");
+        r = list_reply(c, next, sizeof(next));
+        break;
+    }
+    case OP_DOWNLOAD: r = download_reply(c, op->a1, op->a2[0] ? op->a2 : NULL, 0); break;
+    case OP_RENAME:   r = ack_reply(c, "Renamed."); break;
+    default:          r = ack_reply(c, "Deleted."); break;
+    }
+    pl->head = (pl->head + 1) % PIPELINE_DEPTH;
+    pl->count--;
+    pl->bytes -= op->req_len;
+    if (r < 0) pl->failed++; else pl->ok++;
+    return (r == CONN_LOST) ? CONN_LOST : 0;
+}
+
+static int pipeline_drain(conn_t *c, pipeline_t *pl) {
+    while (pl->count > 0) {
+        if (pipeline_complete(c, pl) == CONN_LOST) return CONN_LOST;
+    }
+    return 0;
+}
+
+static int pipeline_push(conn_t *c, pipeline_t *pl, int kind, const char *a1, const char *a2, const char *req) {
+    size_t len = strlen(req);
+    while (pl->count == PIPELINE_DEPTH || pl->bytes + len > PIPELINE_BYTES) {
+        if (pipeline_complete(c, pl) == CONN_LOST) return CONN_LOST;
+    }
+    batch_op_t *op = &pl->ops[(pl->head + pl->count) % PIPELINE_DEPTH];
+    op->kind = kind;
+    snprintf(op->a1, sizeof(op->a1), "%s", a1);
+    snprintf(op->a2, sizeof(op->a2), "%s", a2);
+    op->req_len = len;
+    memcpy(pl->out + pl->out_len, req, len);
+    pl->out_len += len;
+    pl->bytes += len;
+    pl->count++;
+    return 0;
+}
+
+static int do_batch(conn_t *c, const char *path) {
+    FILE *f = fopen(path, "r");
+    if (!f) { perror("open batch file"); return -1; }
+    pipeline_t *pl = (pipeline_t *)calloc(1, sizeof(pipeline_t));
+    if (!pl) { fprintf(stderr, "oom\n"); fclose(f); return -1; }
+
+    char line[MAX_LINE], req[MAX_LINE], a1[1024], a2[1024];
+    int r = 0;
+    while (r != CONN_LOST && fgets(line, sizeof(line), f)) {
+        memset(a1, 0, sizeof(a1)); memset(a2, 0, sizeof(a2));
+        chomp(line);
+        if (line[0] == '\0' || line[0] == '#') continue;
+        if (strncmp(line, "list", 4) == 0) {
+            r = pipeline_push(c, pl, OP_LIST, "", "", "LIST\n");
+        }
+        else if (sscanf(line, "download %1023s %1023s", a1, a2) >= 1) {
+            snprintf(req, sizeof(req), "DOWNLOAD %s%s\n", a1, lz4_wire ? " 0 -1 lz4" : "");
+            r = pipeline_push(c, pl, OP_DOWNLOAD, a1, a2, req);
+        }
+        else if (sscanf(line, "rename %1023s %1023s", a1, a2) == 2) {
+            snprintf(req, sizeof(req), "RENAME %s %s\n", a1, a2);
+            r = pipeline_push(c, pl, OP_RENAME, a1, a2, req);
+        }
+        else if (sscanf(line, "delete %1023s", a1) == 1) {
+            snprintf(req, sizeof(req), "DELETE %s\n", a1);
+            r = pipeline_push(c, pl, OP_DELETE, a1, "", req);
+        }
+        else if (sscanf(line, "upload %1023s %1023s", a1, a2) >= 1) {
+            r = pipeline_drain(c, pl);
+            if (r == 0) {
+                if (do_upload(c, a1, a2[0] ? a2 : NULL) < 0) pl->failed++; else pl->ok++;
+            }
+        }
+        else {
+            fprintf(stderr, "batch: skipping '%s'\n", line);
+        }
+    }
+    if (r != CONN_LOST) pipeline_drain(c, pl);
+    printf("Batch done: %d ok, %d failed\n", pl->ok, pl->failed);
+    free(pl);
+    fclose(f);
+    return 0;
+}
+
 int main(int argc, char **argv) {
+    const char *prog = argv[0];
+    crc32c_init();
+    bool want_lz4 = false;
+    for (;;) {
+        if (argc >= 3 && strcmp(argv[1], "-j") == 0) {
+            streams = atoi(argv[2]);
+            if (streams < 1) streams = 1;
+            if (streams > MAX_STREAMS) streams = MAX_STREAMS;
+            argv += 2;
+            argc -= 2;
+        } else if (argc >= 2 && strcmp(argv[1], "-z") == 0) {
+            want_lz4 = true;
+            argv++;
+            argc--;
+        } else {
+            break;
+        }
+    }
     if (argc < 3) {
-        fprintf(stderr, "Usage: %s <server_ip> <port>\n", argv[0]);
+        fprintf(stderr, "Usage: %s [-j N] [-z] <server_ip> <port>\n", prog);
         return 1;
     }
     const char *ip = argv[1];
@@ -254,11 +1152,26 @@ int main(int argc, char **argv) {
         return 1;
     }
 
+    conn_t *c = (conn_t *)calloc(1, sizeof(conn_t));
+    if (!c) { fprintf(stderr, "oom\n"); close(sfd); return 1; }
+    c->fd = sfd;
+    c->addr = addr;
+
     // Show server greeting
     char line[MAX_LINE];
-    if (recv_line(sfd, line, sizeof(line)) > 0) {
-        fputs(line, stdout);
+    if (recv_line(c, line, sizeof(line)) <= 0) {
+        fprintf(stderr, "server closed\n");
+        close(sfd); free(c);
+        return 1;
     }
+    if (strncmp(line, "ERR", 3) == 0) { // e.g. "ERR busy" when the server is saturated
+        fputs(line, stderr);
+        close(sfd); free(c);
+        return 1;
+    }
+    fputs(line, stdout);
+    chomp(line);
+    lz4_wire = want_lz4 && strstr(line, " lz4") != NULL;
 
     // Simple REPL
     for (;;) {
@@ -268,30 +1181,42 @@ int main(int argc, char **argv) {
         char cmd[64], a1[1024], a2[1024];
         memset(cmd,0,sizeof(cmd)); memset(a1,0,sizeof(a1)); memset(a2,0,sizeof(a2));
 
-        if (sscanf(line, "list") == 0 && strncmp(line, "list", 4) == 0) {
-            if (do_list(sfd) < 0) {}
+        if (sscanf(line, "list %1023s", a1) == 1) {
+            do_list(c, a1);
+        }
+        else if (strncmp(line, "list", 4) == 0) {
+            do_list(c, NULL);
         }
         else if (sscanf(line, "upload %1023s %1023s", a1, a2) == 2) {
-            do_upload(sfd, a1, a2);
+            do_upload(c, a1, a2);
         }
         else if (sscanf(line, "upload %1023s", a1) == 1) {
-            do_upload(sfd, a1, NULL);
+            do_upload(c, a1, NULL);
         }
         else if (sscanf(line, "download %1023s %1023s", a1, a2) == 2) {
-            do_download(sfd, a1, a2);
+            do_download(c, a1, a2);
         }
         else if (sscanf(line, "download %1023s", a1) == 1) {
-            do_download(sfd, a1, NULL);
+            do_download(c, a1, NULL);
+        }
+        else if (sscanf(line, "stat %1023s", a1) == 1) {
+            do_stat(c, a1);
+        }
+        else if (sscanf(line, "versions %1023s", a1) == 1) {
+            do_versions(c, a1);
         }
         else if (sscanf(line, "rename %1023s %1023s", a1, a2) == 2) {
-            do_rename_remote(sfd, a1, a2);
+            do_rename_remote(c, a1, a2);
         }
         else if (sscanf(line, "delete %1023s", a1) == 1) {
-            do_delete_remote(sfd, a1);
+            do_delete_remote(c, a1);
+        }
+        else if (sscanf(line, "batch %1023s", a1) == 1) {
+            do_batch(c, a1);
         }
         else if (strncmp(line, "quit", 4) == 0) {
-            send_line(sfd, "QUIT\n");
-            if (recv_line(sfd, line, sizeof(line)) > 0) fputs(line, stdout);
+            send_line(c->fd, "QUIT\n");
+            if (recv_line(c, line, sizeof(line)) > 0) fputs(line, stdout);
             break;
         }
         else if (strncmp(line, "\n", 1) == 0) {
@@ -299,16 +1224,20 @@ int main(int argc, char **argv) {
         }
         else {
             printf("Commands:\n");
-            printf("  list\n");
+            printf("  list [prefix]\n");
             printf("  upload <localpath> [remote_name]\n");
             printf("  download <remote_name> [save_as]\n");
+            printf("  stat <remote_name>\n");
+            printf("  versions <remote_name>  (then: download <remote_name>@<id>)\n");
             printf("  rename <oldname> <newname>\n");
             printf("  delete <remote_name>\n");
+            printf("  batch <command_file>\n");
             printf("  quit\n");
         }
     }
 
-    close(sfd);
+    close(c->fd);
+    free(c);
     return 0;
 }
 
@@ -0,0 +1,141 @@
+// crc32c.c - CRC32C (Castagnoli) checksums for the server and client
+// On x86-64 with SSE4.2 the crc32 instruction runs over three interleaved
+// streams whose results are combined with precomputed shift tables, which
+// keeps up with memory bandwidth; elsewhere a slicing-by-8 table loop is used.
+
+#include "crc32c.h"
+
+#include <string.h>
+
+#define CRC32C_POLY 0x82f63b78
+#define CRC32C_LONG 8192
+#define CRC32C_SHORT 256
+
+static uint32_t crc32c_table[8][256];
+static uint32_t crc32c_long[4][256], crc32c_short[4][256];
+bool crc32c_has_hw;
+
+static uint32_t gf2_matrix_times(const uint32_t *mat, uint32_t vec) {
+    uint32_t sum = 0;
+    for (; vec; vec >>= 1, mat++) {
+        if (vec & 1) sum ^= *mat;
+    }
+    return sum;
+}
+
+static void gf2_matrix_square(uint32_t *square, const uint32_t *mat) {
+    for (int n = 0; n < 32; n++) square[n] = gf2_matrix_times(mat, mat[n]);
+}
+
+// Tables that advance a CRC over `len` (a power of two) zero bytes.
+static void crc32c_zeros(uint32_t zeros[4][256], size_t len) {
+    uint32_t even[32], odd[32], row = 1;
+    odd[0] = CRC32C_POLY; // operator for one zero bit
+    for (int n = 1; n < 32; n++, row <<= 1) odd[n] = row;
+    gf2_matrix_square(even, odd);  // two zero bits
+    gf2_matrix_square(odd, even);  // four
+    const uint32_t *op = NULL;
+    for (;;) {
+        gf2_matrix_square(even, odd); // 8, 32, 128, ... bits
+        len >>= 1;
+        if (len == 0) { op = even; break; }
+        gf2_matrix_square(odd, even); // 16, 64, 256, ... bits
+        len >>= 1;
+        if (len == 0) { op = odd; break; }
+    }
+    for (uint32_t n = 0; n < 256; n++) {
+        zeros[0][n] = gf2_matrix_times(op, n);
+        zeros[1][n] = gf2_matrix_times(op, n << 8);
+        zeros[2][n] = gf2_matrix_times(op, n << 16);
+        zeros[3][n] = gf2_matrix_times(op, n << 24);
+    }
+}
+
+static uint32_t crc32c_shift(uint32_t zeros[4][256], uint32_t crc) {
+    return zeros[0][crc & 0xff] ^ zeros[1][(crc >> 8) & 0xff] ^
+           zeros[2][(crc >> 16) & 0xff] ^ zeros[3][crc >> 24];
+}
+
+void crc32c_init(void) {
+    for (uint32_t n = 0; n < 256; n++) {
+        uint32_t crc = n;
+        for (int k = 0; k < 8; k++) crc = (crc & 1) ? (crc >> 1) ^ CRC32C_POLY : crc >> 1;
+        crc32c_table[0][n] = crc;
+    }
+    for (uint32_t n = 0; n < 256; n++) {
+        uint32_t crc = crc32c_table[0][n];
+        for (int k = 1; k < 8; k++) {
+            crc = crc32c_table[0][crc & 0xff] ^ (crc >> 8);
+            crc32c_table[k][n] = crc;
+        }
+    }
+    crc32c_zeros(crc32c_long, CRC32C_LONG);
+    crc32c_zeros(crc32c_short, CRC32C_SHORT);
+#if defined(__x86_64__)
+    crc32c_has_hw = __builtin_cpu_supports("sse4.2");
+#endif
+}
+
+uint32_t crc32c_sw(uint32_t crc, const void *buf, size_t n) {
+    const uint8_t *p = (const uint8_t *)buf;
+    uint64_t c = crc ^ 0xffffffff;
+    while (n && ((uintptr_t)p & 7)) {
+        c = crc32c_table[0][(c ^ *p++) & 0xff] ^ (c >> 8);
+        n--;
+    }
+    for (; n >= 8; p += 8, n -= 8) {
+        uint64_t v;
+        memcpy(&v, p, 8);
+        c ^= v;
+        c = crc32c_table[7][c & 0xff] ^ crc32c_table[6][(c >> 8) & 0xff] ^
+            crc32c_table[5][(c >> 16) & 0xff] ^ crc32c_table[4][(c >> 24) & 0xff] ^
+            crc32c_table[3][(c >> 32) & 0xff] ^ crc32c_table[2][(c >> 40) & 0xff] ^
+            crc32c_table[1][(c >> 48) & 0xff] ^ crc32c_table[0][c >> 56];
+    }
+    while (n--) c = crc32c_table[0][(c ^ *p++) & 0xff] ^ (c >> 8);
+    return (uint32_t)c ^ 0xffffffff;
+}
+
+#if defined(__x86_64__)
+__attribute__((target("sse4.2")))
+static uint32_t crc32c_hw(uint32_t crc, const uint8_t *p, size_t n) {
+    uint64_t c0 = crc ^ 0xffffffff;
+    while (n && ((uintptr_t)p & 7)) {
+        c0 = __builtin_ia32_crc32qi((uint32_t)c0, *p++);
+        n--;
+    }
+    // Three independent streams hide the instruction's 3-cycle latency.
+    for (size_t blk = CRC32C_LONG; blk >= CRC32C_SHORT; blk = (blk == CRC32C_LONG) ? CRC32C_SHORT : 0) {
+        uint32_t (*zeros)[256] = (blk == CRC32C_LONG) ? crc32c_long : crc32c_short;
+        while (n >= 3 * blk) {
+            uint64_t c1 = 0, c2 = 0, v;
+            for (const uint8_t *end = p + blk; p < end; p += 8) {
+                memcpy(&v, p, 8);
+                c0 = __builtin_ia32_crc32di(c0, v);
+                memcpy(&v, p + blk, 8);
+                c1 = __builtin_ia32_crc32di(c1, v);
+                memcpy(&v, p + 2 * blk, 8);
+                c2 = __builtin_ia32_crc32di(c2, v);
+            }
+            c0 = crc32c_shift(zeros, (uint32_t)c0) ^ (uint32_t)c1;
+            c0 = crc32c_shift(zeros, (uint32_t)c0) ^ (uint32_t)c2;
+            p += 2 * blk;
+            n -= 3 * blk;
+        }
+    }
+    for (; n >= 8; p += 8, n -= 8) {
+        uint64_t v;
+        memcpy(&v, p, 8);
+        c0 = __builtin_ia32_crc32di(c0, v);
+    }
+    while (n--) c0 = __builtin_ia32_crc32qi((uint32_t)c0, *p++);
+    return (uint32_t)c0 ^ 0xffffffff;
+}
+#endif
+
+uint32_t crc32c(uint32_t crc, const void *buf, size_t n) {
+#if defined(__x86_64__)
+    if (crc32c_has_hw) return crc32c_hw(crc, (const uint8_t *)buf, n);
+#endif
+    return crc32c_sw(crc, buf, n);
+}
@@ -0,0 +1,20 @@
+// crc32c.h - CRC32C (Castagnoli) checksums for the server and client
+#ifndef CRC32C_H
+#define CRC32C_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+extern bool crc32c_has_hw;      // SSE4.2 crc32 instruction in use
+
+// Call once before the others.
+void crc32c_init(void);
+
+// crc32c(0, ...) starts a checksum and crc32c(prev, ...) continues one.
+uint32_t crc32c(uint32_t crc, const void *buf, size_t n);
+
+// The table loop alone, whatever the CPU (for --bench-crc).
+uint32_t crc32c_sw(uint32_t crc, const void *buf, size_t n);
+
+#endif
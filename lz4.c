@@ -0,0 +1,120 @@
+// lz4.c - LZ4 block format codec for the server and client
+// A hash-table match finder (greedy, skipping ahead faster through
+// incompressible data) and a bounds-checked decoder.
+
+#include "lz4.h"
+
+#include <arpa/inet.h>
+#include <stdbool.h>
+#include <string.h>
+
+#define LZ_HASH_BITS 13
+#define LZ_LAST_LITERALS 5      // the format ends every block with literals
+#define LZ_MFLIMIT 12           // ... and starts no match closer to the end
+
+static uint32_t lz_read32(const uint8_t *p) {
+    uint32_t v;
+    memcpy(&v, p, 4);
+    return v;
+}
+
+static uint8_t *lz_put_len(uint8_t *op, size_t len) {
+    for (; len >= 255; len -= 255) *op++ = 255;
+    *op++ = (uint8_t)len;
+    return op;
+}
+
+// Compressed size, or 0 if the result wouldn't be smaller than cap.
+size_t lz4_compress(const uint8_t *src, size_t n, uint8_t *dst, size_t cap) {
+    uint32_t table[1 << LZ_HASH_BITS];
+    const uint8_t *ip = src, *anchor = src, *end = src + n;
+    uint8_t *op = dst, *oend = dst + cap;
+    memset(table, 0, sizeof(table));
+    if (n > LZ_MFLIMIT) {
+        const uint8_t *mflimit = end - LZ_MFLIMIT, *mlimit = end - LZ_LAST_LITERALS;
+        unsigned misses = 0;
+        ip++;
+        while (ip < mflimit) {
+            uint32_t seq = lz_read32(ip);
+            uint32_t h = (seq * 2654435761u) >> (32 - LZ_HASH_BITS);
+            const uint8_t *ref = src + table[h];
+            table[h] = (uint32_t)(ip - src);
+            if (ref >= ip || ip - ref > 65535 || lz_read32(ref) != seq) {
+                ip += 1 + (misses++ >> 6);
+                continue;
+            }
+            misses = 0;
+            while (ip > anchor && ref > src && ip[-1] == ref[-1]) { ip--; ref--; }
+            const uint8_t *p = ip + 4, *q = ref + 4;
+            while (p < mlimit && *p == *q) { p++; q++; }
+            size_t lit = (size_t)(ip - anchor), mlen = (size_t)(p - ip) - 4;
+            if ((size_t)(oend - op) < lit + lit / 255 + mlen / 255 + 5) return 0;
+            uint8_t *token = op++;
+            *token = (uint8_t)(((lit < 15) ? lit : 15) << 4 | ((mlen < 15) ? mlen : 15));
+            if (lit >= 15) op = lz_put_len(op, lit - 15);
+            memcpy(op, anchor, lit);
+            op += lit;
+            *op++ = (uint8_t)(ip - ref);
+            *op++ = (uint8_t)((ip - ref) >> 8);
+            if (mlen >= 15) op = lz_put_len(op, mlen - 15);
+            ip = anchor = p;
+        }
+    }
+    size_t lit = (size_t)(end - anchor);
+    if ((size_t)(oend - op) < lit + lit / 255 + 2) return 0;
+    *op++ = (uint8_t)(((lit < 15) ? lit : 15) << 4);
+    if (lit >= 15) op = lz_put_len(op, lit - 15);
+    memcpy(op, anchor, lit);
+    op += lit;
+    return (size_t)(op - dst);
+}
+
+static bool lz_get_len(const uint8_t **ip, const uint8_t *iend, size_t *len) {
+    unsigned b;
+    do {
+        if (*ip >= iend) return false;
+        b = *(*ip)++;
+        *len += b;
+    } while (b == 255);
+    return true;
+}
+
+// Decoded size, or -1 for malformed input or more than cap bytes of output.
+long lz4_decompress(const uint8_t *src, size_t n, uint8_t *dst, size_t cap) {
+    const uint8_t *ip = src, *iend = src + n;
+    uint8_t *op = dst, *oend = dst + cap;
+    while (ip < iend) {
+        unsigned token = *ip++;
+        size_t lit = token >> 4, mlen = token & 15;
+        if (lit == 15 && !lz_get_len(&ip, iend, &lit)) return -1;
+        if (lit > (size_t)(iend - ip) || lit > (size_t)(oend - op)) return -1;
+        memcpy(op, ip, lit);
+        op += lit;
+        ip += lit;
+        if (ip == iend) break; // the last sequence has no match
+        if (iend - ip < 2) return -1;
+        size_t off = (size_t)ip[0] | (size_t)ip[1] << 8;
+        ip += 2;
+        if (off == 0 || off > (size_t)(op - dst)) return -1;
+        if (mlen == 15 && !lz_get_len(&ip, iend, &mlen)) return -1;
+        mlen += 4;
+        if (mlen > (size_t)(oend - op)) return -1;
+        const uint8_t *m = op - off;
+        if (off >= mlen) memcpy(op, m, mlen);
+        else for (size_t i = 0; i < mlen; i++) op[i] = m[i]; // overlapping run
+        op += mlen;
+    }
+    return (long)(op - dst);
+}
+
+// Frames n raw bytes into out (ZFRAME_MAX bytes); returns the frame length.
+size_t zframe_pack(const void *raw, size_t n, uint8_t *out) {
+    size_t z = lz4_compress((const uint8_t *)raw, n, out + 8, n > 0 ? n - 1 : 0);
+    if (z == 0) {
+        memcpy(out + 8, raw, n);
+        z = n;
+    }
+    uint32_t hdr[2] = { htonl((uint32_t)n), htonl((uint32_t)z) };
+    memcpy(out, hdr, 8);
+    return 8 + z;
+}
@@ -0,0 +1,24 @@
+// lz4.h - LZ4 block format codec for the server and client
+// Compressed bodies travel as frames of at most ZBLOCK raw bytes, each
+// "<raw_len><stored_len>" (two 32-bit big-endian words) then the payload;
+// stored_len == raw_len means the block didn't compress and is sent as is.
+#ifndef LZ4_H
+#define LZ4_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define ZBLOCK (1 << 16)
+#define ZBOUND(n) ((n) + (n) / 255 + 16)
+#define ZFRAME_MAX (8 + ZBOUND(ZBLOCK))
+
+// Compressed size, or 0 if the result wouldn't be smaller than cap.
+size_t lz4_compress(const uint8_t *src, size_t n, uint8_t *dst, size_t cap);
+
+// Decoded size, or -1 for malformed input or more than cap bytes of output.
+long lz4_decompress(const uint8_t *src, size_t n, uint8_t *dst, size_t cap);
+
+// Frames n raw bytes into out (ZFRAME_MAX bytes); returns the frame length.
+size_t zframe_pack(const void *raw, size_t n, uint8_t *out);
+
+#endif
@@ -1,12 +1,27 @@
 // server.c - Mini Cloud Storage Server (C, POSIX, Ubuntu/WSL)
 // Build: make
-// Run:   ./server <port> [storage_dir]
+// Run:   ./server <port> [storage_dir] [--engine=threads|epoll|uring] [--loops N]
+//                 [--reuseport] [--pin] [--workers N] [--max-conns M]
+//                 [--fsync=always|group|none] [--fsync-window-us N] [--dedup | --compress]
+//                 [--shared-dir] [--versions N] [--version-days D] [--small-max N]
+//        ./server --bench-crc
 // Example: ./server 8080 storage
+//          ./server 8080 storage --engine=epoll --loops 4
+//          ./server 8080 storage --engine=epoll --reuseport --pin
 //
 // Protocol (client -> server):
-//   LIST
-//   UPLOAD <filename> <size>
-//   DOWNLOAD <filename>
+//   LIST [prefix] [start_after] [limit]
+//   UPLOAD <filename> <size> [crc|- [lz4]]  (crc: refuse the body unless it matches)
+//   UPLOAD_BEGIN <filename> <size>          -> OK <id>
+//   UPLOAD_PART <id> <offset> <length> [lz4]  -> OK, body, OK RECEIVED <end>
+//   UPLOAD_STATUS <id>                      -> OK <received> <size>
+//   UPLOAD_COMMIT <id> [crc] / UPLOAD_ABORT <id>  -> OK SAVED / OK ABORTED
+//   SIGNATURE <filename>                    -> OK <size> <block> <n>, n block sums
+//   UPLOAD_COPY <id> <offset> <length> <src_offset>  -> OK RECEIVED <end>
+//   DOWNLOAD <filename> [offset [length [lz4]]]   (length -1: to the end)
+//   STAT <filename>                         -> OK <size> <mtime> <crc|->
+//   VERSIONS <filename>                     -> OK <n>, n x VERSION <id> <size> <mtime> <crc|->
+//   HAVE <filename> <size> <crc>            -> OK HAVE / OK MISSING
 //   RENAME <oldname> <newname>
 //   DELETE <filename>
 //   QUIT
@@ -14,38 +29,124 @@
 // Responses:
 //   On success: "OK ..." lines followed by data when applicable
 //   On error:   "ERR <message>\n"
+//   DOWNLOAD: "OK <n> [crc]" and the n bytes of the requested range (default:
+//         all); crc is the CRC32C of the whole object, in hex, when known.
+//   "OK WELCOME lz4" on connect: bodies may travel LZ4 compressed. A transfer
+//   asks for it with the lz4 argument; the DOWNLOAD reply is then
+//   "OK <n> <crc|-> lz4". Such bodies are frames of up to 64 KiB raw bytes:
+//   <raw_len> <stored_len> (32-bit big-endian) and the LZ4 block, or the raw
+//   bytes when stored_len == raw_len.
+//   LIST: "OK <n>", n x "FILE <name> <size> [crc]" in name order, then "END" or,
+//         if limit cut it short, "NEXT <last_name>" to pass as start_after.
+//   With --versions/--version-days, objects replaced or deleted are kept as
+//   versions; DOWNLOAD <filename>@<id> reads one of those VERSIONS lists.
+// Commands may be pipelined (sent without waiting for replies); they are
+// executed and answered strictly in order. UPLOAD bodies must still wait for
+// the "OK" go-ahead.
 //
-// Concurrency: Each client handled by a thread. File ops use fcntl() advisory locks.
+// Concurrency:
+//   --engine=threads (default): a fixed pool of --workers threads (default 64),
+//     each serving one client at a time, fed by the acceptor through a bounded
+//     queue. Once --max-conns clients (default 4 x workers) are being served or
+//     waiting, new connections get "ERR busy" and are closed.
+//   --engine=epoll: N event loops (--loops, default one per CPU) multiplex all
+//     connections with edge-triggered epoll over non-blocking sockets. Each
+//     connection is a small state machine (command / upload body / download body).
+//     --max-conns (default unlimited) caps open connections the same way.
+//     --reuseport gives every loop its own SO_REUSEPORT listener (the kernel
+//     load-balances new connections, no shared accept queue); --pin pins loop
+//     i to CPU i.
+//   --engine=uring: like threads, but UPLOAD/DOWNLOAD bodies move through a
+//     per-thread io_uring with registered buffers and fixed files, batching the
+//     socket and file I/O of each chunk into one io_uring_enter(). Falls back to
+//     threads when the kernel does not allow io_uring.
+// RENAME, DELETE and publishing an upload exclude each other per name through
+// an in-process table of sharded rwlocks (plus OFD locks with --shared-dir,
+// for several servers on one directory). LIST is served from an in-memory index
+// of the storage directory built at startup; with --shared-dir, LIST, STAT and
+// HAVE first refresh it from the files. Objects are fanned out over
+// storage_dir/xx/yy/ by name hash (see fanout_path()); a flat directory of an
+// older version is migrated then.
+// UPLOAD writes to an O_TMPFILE (or a temp file under storage_dir/.mcs/tmp) and
+// atomically renames it over the object on success, so readers never see a
+// partial file and a failed upload leaves the previous version intact.
+// UPLOAD_BEGIN/PART/COMMIT is a resumable upload: the session is kept under
+// storage_dir/.mcs/sessions across disconnects and restarts, and a client
+// continues from the received count UPLOAD_STATUS reports.
+// Large UPLOAD bodies are spliced socket -> pipe -> file (zero copy), mirroring
+// sendfile() on DOWNLOAD; the copy loop remains as fallback.
+// --dedup stores upload bodies as content-defined chunks, each unique chunk
+// once, with the object file holding their manifest (see chunk_store_t).
+// --compress stores them as independently LZ4-compressed 64 KiB blocks with a
+// block index, so range reads decompress only what they touch (see packed_t).
+// --small-max packs small uploads as needles into append-only volume files,
+// located through the LIST index and compacted in the background (see needle_t).
+// --fsync=group batches the flushes of concurrent uploads (see group_commit_t).
 
 #define _GNU_SOURCE
 #include <arpa/inet.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <linux/io_uring.h>
 #include <netinet/in.h>
 #include <pthread.h>
 #include <signal.h>
 #include <stdarg.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/random.h>
 #include <sys/sendfile.h>
 #include <sys/socket.h>
 #include <sys/stat.h>
+#include <sys/syscall.h>
 #include <sys/types.h>
+#include <sys/uio.h>
+#include <sys/xattr.h>
+#include <time.h>
 #include <unistd.h>
 #include <dirent.h>
 
+#include "crc32c.h"
+#include "lz4.h"
+
 #define BACKLOG 64
 #define MAX_LINE 4096
 #define MAX_PATH 1024
+#define RBUF_SIZE (2 * MAX_LINE)
+#define META_DIR ".mcs"   // server-private state inside storage_dir, never listed
+#define IO_BUF (1 << 16)
+#define SPLICE_MIN (1 << 16) // uploads at least this big are spliced
+#define SESSION_ID_LEN 16
+#define SESSION_TTL (7 * 24 * 3600) // idle upload sessions are dropped at startup after this
+#define MAX_EVENTS 256
+#define DEFAULT_WORKERS 64
+
+enum { ENGINE_THREADS, ENGINE_EPOLL, ENGINE_URING };
 
+// Accepted sockets waiting for a worker (threads/uring engines). Bounded: the
+// acceptor answers "ERR busy" instead of queueing past max_conns.
 typedef struct {
-    int client_fd;
-    char storage_dir[MAX_PATH];
-} client_ctx_t;
+    int *fds;
+    int cap, head, count;
+    int active;                 // connections currently held by workers
+    const char *storage_dir;
+    pthread_mutex_t mu;
+    pthread_cond_t not_empty;
+} work_queue_t;
 
 static volatile sig_atomic_t running = 1;
+static int engine = ENGINE_THREADS;
+static int max_conns = 0;       // 0: no limit (epoll) / 4 x workers (threads)
+static int open_conns = 0;      // epoll engine, updated atomically
+static bool reuseport = false;  // epoll engine: one SO_REUSEPORT listener per loop
+static bool pin_cpus = false;   // epoll engine: pin loop i to CPU i
 
 static void on_sigint(int sig) {
     (void)sig;
@@ -60,374 +161,3967 @@ static void die(const char *fmt, ...) {
     exit(1);
 }
 
-static ssize_t send_all(int fd, const void *buf, size_t len) {
-    const char *p = (const char *)buf;
-    size_t sent = 0;
-    while (sent < len) {
-        ssize_t n = send(fd, p + sent, len - sent, 0);
-        if (n < 0) {
+// Buffered reader: one recv() pulls in as much as fits, then command lines are
+// parsed out of memory. Bytes behind a line (e.g. the start of an UPLOAD body)
+// stay buffered for whoever consumes the stream next.
+typedef struct {
+    char data[RBUF_SIZE];
+    size_t head, tail;          // unread bytes are data[head..tail)
+} rbuf_t;
+
+static size_t rbuf_len(const rbuf_t *rb) {
+    return rb->tail - rb->head;
+}
+
+static const char *rbuf_peek(const rbuf_t *rb) {
+    return rb->data + rb->head;
+}
+
+static void rbuf_consume(rbuf_t *rb, size_t n) {
+    rb->head += n;
+    if (rb->head == rb->tail) rb->head = rb->tail = 0;
+}
+
+static bool rbuf_has_line(const rbuf_t *rb) {
+    return memchr(rbuf_peek(rb), '\n', rbuf_len(rb)) != NULL;
+}
+
+static bool rbuf_full(const rbuf_t *rb) {
+    return rb->head == 0 && rb->tail == RBUF_SIZE;
+}
+
+// One recv() into the free space. Returns bytes read, 0 on EOF, -1 on error
+// (errno EAGAIN when a non-blocking socket is drained).
+static ssize_t rbuf_fill(rbuf_t *rb, int fd) {
+    if (rb->tail == RBUF_SIZE && rb->head > 0) {
+        memmove(rb->data, rb->data + rb->head, rbuf_len(rb));
+        rb->tail -= rb->head;
+        rb->head = 0;
+    }
+    for (;;) {
+        ssize_t n = recv(fd, rb->data + rb->tail, RBUF_SIZE - rb->tail, 0);
+        if (n < 0 && errno == EINTR) continue;
+        if (n > 0) rb->tail += (size_t)n;
+        return n;
+    }
+}
+
+// Pop one '\n'-terminated line into out (NUL-terminated, truncated to cap-1).
+// Returns its length, or 0 if no complete line is buffered yet.
+static size_t rbuf_getline(rbuf_t *rb, char *out, size_t cap) {
+    const char *start = rbuf_peek(rb);
+    const char *nl = (const char *)memchr(start, '\n', rbuf_len(rb));
+    if (!nl) return 0;
+    size_t len = (size_t)(nl - start) + 1;
+    size_t n = (len < cap) ? len : cap - 1;
+    memcpy(out, start, n);
+    out[n] = '\0';
+    rbuf_consume(rb, len);
+    return n;
+}
+
+static void chomp(char *s) {
+    size_t n = strlen(s);
+    while (n && (s[n-1] == '\n' || s[n-1] == '\r')) {
+        s[--n] = 0;
+    }
+}
+
+// Minimal io_uring wrapper (raw syscalls, no liburing) used by --engine=uring.
+// Each serving thread owns one ring with URING_BUFS registered IO_BUF buffers
+// and a two-slot fixed-file table: the client socket and the file in transfer.
+#define URING_BUFS 4
+#define URING_SOCK_SLOT 0
+#define URING_FILE_SLOT 1
+
+typedef struct {
+    int fd;
+    unsigned *sq_tail, *sq_mask, *sq_array;
+    unsigned *cq_head, *cq_tail, *cq_mask;
+    struct io_uring_sqe *sqes;
+    struct io_uring_cqe *cqes;
+    void *sq_ring, *cq_ring;
+    size_t sq_ring_sz, cq_ring_sz, sqes_sz;
+    unsigned pending;           // SQEs queued since the last submit
+    char *bufs;                 // URING_BUFS * IO_BUF, registered with the kernel
+} uring_t;
+
+static void uring_close(uring_t *u) {
+    if (!u) return;
+    if (u->sqes) munmap(u->sqes, u->sqes_sz);
+    if (u->cq_ring && u->cq_ring != u->sq_ring) munmap(u->cq_ring, u->cq_ring_sz);
+    if (u->sq_ring) munmap(u->sq_ring, u->sq_ring_sz);
+    if (u->fd >= 0) close(u->fd);
+    free(u->bufs);
+    free(u);
+}
+
+// Returns NULL when the kernel (or a seccomp policy) does not allow io_uring.
+static uring_t *uring_open(void) {
+    uring_t *u = (uring_t *)calloc(1, sizeof(uring_t));
+    if (!u) return NULL;
+    struct io_uring_params p;
+    memset(&p, 0, sizeof(p));
+    u->fd = (int)syscall(__NR_io_uring_setup, 2 * URING_BUFS, &p);
+    if (u->fd < 0) { free(u); return NULL; }
+
+    u->sq_ring_sz = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    u->cq_ring_sz = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        if (u->cq_ring_sz > u->sq_ring_sz) u->sq_ring_sz = u->cq_ring_sz;
+        u->cq_ring_sz = u->sq_ring_sz;
+    }
+    u->sq_ring = mmap(NULL, u->sq_ring_sz, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                      u->fd, IORING_OFF_SQ_RING);
+    if (u->sq_ring == MAP_FAILED) { u->sq_ring = NULL; uring_close(u); return NULL; }
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        u->cq_ring = u->sq_ring;
+    } else {
+        u->cq_ring = mmap(NULL, u->cq_ring_sz, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                          u->fd, IORING_OFF_CQ_RING);
+        if (u->cq_ring == MAP_FAILED) { u->cq_ring = NULL; uring_close(u); return NULL; }
+    }
+    u->sqes_sz = p.sq_entries * sizeof(struct io_uring_sqe);
+    u->sqes = (struct io_uring_sqe *)mmap(NULL, u->sqes_sz, PROT_READ | PROT_WRITE,
+                                          MAP_SHARED | MAP_POPULATE, u->fd, IORING_OFF_SQES);
+    if (u->sqes == MAP_FAILED) { u->sqes = NULL; uring_close(u); return NULL; }
+
+    char *sq = (char *)u->sq_ring, *cq = (char *)u->cq_ring;
+    u->sq_tail = (unsigned *)(sq + p.sq_off.tail);
+    u->sq_mask = (unsigned *)(sq + p.sq_off.ring_mask);
+    u->sq_array = (unsigned *)(sq + p.sq_off.array);
+    u->cq_head = (unsigned *)(cq + p.cq_off.head);
+    u->cq_tail = (unsigned *)(cq + p.cq_off.tail);
+    u->cq_mask = (unsigned *)(cq + p.cq_off.ring_mask);
+    u->cqes = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+
+    u->bufs = (char *)malloc((size_t)URING_BUFS * IO_BUF);
+    if (!u->bufs) { uring_close(u); return NULL; }
+    struct iovec iov[URING_BUFS];
+    for (int i = 0; i < URING_BUFS; i++) {
+        iov[i].iov_base = u->bufs + (size_t)i * IO_BUF;
+        iov[i].iov_len = IO_BUF;
+    }
+    int files[2] = { -1, -1 };
+    if (syscall(__NR_io_uring_register, u->fd, IORING_REGISTER_BUFFERS, iov, URING_BUFS) < 0 ||
+        syscall(__NR_io_uring_register, u->fd, IORING_REGISTER_FILES, files, 2) < 0) {
+        uring_close(u);
+        return NULL;
+    }
+    return u;
+}
+
+static int uring_set_file(uring_t *u, unsigned slot, int fd) {
+    struct io_uring_files_update up;
+    memset(&up, 0, sizeof(up));
+    up.offset = slot;
+    up.fds = (unsigned long)&fd;
+    return (syscall(__NR_io_uring_register, u->fd, IORING_REGISTER_FILES_UPDATE, &up, 1) == 1) ? 0 : -1;
+}
+
+// Queue a READ_FIXED/WRITE_FIXED on a fixed-file slot using registered buffer `buf`.
+static void uring_prep(uring_t *u, int op, unsigned slot, int buf, size_t len, off_t off,
+                       unsigned flags, uint64_t tag) {
+    unsigned tail = *u->sq_tail + u->pending;
+    unsigned idx = tail & *u->sq_mask;
+    struct io_uring_sqe *sqe = &u->sqes[idx];
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->opcode = (uint8_t)op;
+    sqe->flags = (uint8_t)(IOSQE_FIXED_FILE | flags);
+    sqe->fd = (int)slot;
+    sqe->off = (uint64_t)off;
+    sqe->addr = (unsigned long)(u->bufs + (size_t)buf * IO_BUF);
+    sqe->len = (unsigned)len;
+    sqe->buf_index = (uint16_t)buf;
+    sqe->user_data = tag;
+    u->sq_array[idx] = idx;
+    u->pending++;
+}
+
+// Submit everything queued in one io_uring_enter() and wait for as many
+// completions; res[tag] receives each result. Returns -1 if the enter fails.
+static int uring_submit_wait(uring_t *u, int *res) {
+    unsigned n = u->pending, to_submit = n, done = 0;
+    __atomic_store_n(u->sq_tail, *u->sq_tail + n, __ATOMIC_RELEASE);
+    u->pending = 0;
+    for (;;) {
+        unsigned head = *u->cq_head;
+        unsigned tail = __atomic_load_n(u->cq_tail, __ATOMIC_ACQUIRE);
+        while (head != tail) {
+            struct io_uring_cqe *cqe = &u->cqes[head & *u->cq_mask];
+            res[cqe->user_data] = cqe->res;
+            head++;
+            done++;
+        }
+        __atomic_store_n(u->cq_head, head, __ATOMIC_RELEASE);
+        if (done >= n) return 0;
+        long r = syscall(__NR_io_uring_enter, u->fd, to_submit, n - done, IORING_ENTER_GETEVENTS, NULL, 0);
+        if (r < 0) {
             if (errno == EINTR) continue;
             return -1;
         }
-        if (n == 0) break;
-        sent += (size_t)n;
+        to_submit -= (unsigned)r;
     }
-    return (ssize_t)sent;
 }
 
-static ssize_t recv_all(int fd, void *buf, size_t len) {
-    char *p = (char *)buf;
-    size_t recvd = 0;
-    while (recvd < len) {
-        ssize_t n = recv(fd, p + recvd, len - recvd, 0);
-        if (n < 0) {
-            if (errno == EINTR) continue;
-            return -1;
+
+// In-memory metadata index of storage_dir (name -> size, mtime). Built once at
+// startup and kept current by UPLOAD/RENAME/DELETE, so LIST is answered from
+// memory instead of readdir() + stat() per object. Files changed behind the
+// server's back are only picked up on the next start, except with --shared-dir
+// (catalog_sync()).
+// Entries sit in a hash table for exact lookups and in a skip list ordered by
+// name for prefix / start_after range scans.
+#define SKIP_MAX_LEVEL 24
+
+typedef struct meta_entry {
+    struct meta_entry *next;    // hash chain
+    long long size;
+    time_t mtime;
+    long long crc;              // CRC32C of the contents, -1 if unknown
+    int vol;                    // volume slot of a needle, -1 for a file
+    long long voff;             // needle's data offset in it (for a file, at
+                                // startup: 1 if it hides a live needle)
+    char *name;                 // stored right after fwd[]
+    int level;
+    struct meta_entry *fwd[];   // skip list successors, fwd[0] is the next name
+} meta_entry_t;
+
+typedef struct {
+    meta_entry_t **buckets;
+    size_t nbuckets, count;
+    meta_entry_t *head;         // skip list sentinel with SKIP_MAX_LEVEL links
+    int level;
+    uint32_t seed;
+    pthread_rwlock_t lock;
+    bool shared;                // --shared-dir: other servers change objects behind it
+} catalog_t;
+
+static catalog_t catalog = { NULL, 0, 0, NULL, 1, 2463534242u, PTHREAD_RWLOCK_INITIALIZER, false };
+
+static uint64_t name_hash(const char *s) {
+    uint64_t h = 1469598103934665603ULL; // FNV-1a
+    while (*s) {
+        h ^= (unsigned char)*s++;
+        h *= 1099511628211ULL;
+    }
+    return h;
+}
+
+// Objects (and their version directories) are fanned out over two levels of
+// 256 directories named by the top bytes of the name hash in hex,
+// root/xx/yy/name, so no directory holds more than a sliver of them (lookups
+// and the startup scan stay fast).
+static bool fanout_path(char *out, size_t cap, const char *root, const char *name) {
+    uint64_t h = name_hash(name);
+    h ^= h >> 33; // FNV's high bits barely change between similar names: mix
+    h *= 0xff51afd7ed558ccdULL;
+    h ^= h >> 33;
+    int r = snprintf(out, cap, "%s/%02x/%02x/%s", root, (unsigned)(h >> 56), (unsigned)(h >> 48) & 0xff, name);
+    return (r > 0 && (size_t)r < cap);
+}
+
+static bool object_path(char *out, size_t cap, const char *storage_dir, const char *name) {
+    // Reject traversal and the server's private directory
+    if (strstr(name, "..") != NULL || strchr(name, '/') != NULL || strchr(name, '\\') != NULL ||
+        strcmp(name, META_DIR) == 0) {
+        return false;
+    }
+    return fanout_path(out, cap, storage_dir, name);
+}
+
+// Create the two fan-out directories above a fanout_path().
+static bool fanout_dirs(const char *path) {
+    char dir[MAX_PATH];
+    snprintf(dir, sizeof(dir), "%s", path);
+    char *leaf = strrchr(dir, '/');
+    if (!leaf) return false;
+    *leaf = '\0';
+    char *mid = strrchr(dir, '/');
+    if (!mid) return false;
+    *mid = '\0';
+    if (mkdir(dir, 0755) < 0 && errno != EEXIST) return false;
+    *mid = '/';
+    return mkdir(dir, 0755) == 0 || errno == EEXIST;
+}
+
+static bool is_fanout_dir(const char *s) {
+    static const char hex[] = "0123456789abcdef";
+    return s[0] && s[1] && !s[2] && strchr(hex, s[0]) && strchr(hex, s[1]);
+}
+
+// Call fn for the name of each entry `depth` fan-out levels below dir.
+static void fanout_walk(const char *dir, int depth, void (*fn)(const char *name, void *arg), void *arg) {
+    DIR *d = opendir(dir);
+    if (!d) return;
+    struct dirent *de;
+    while ((de = readdir(d)) != NULL) {
+        char path[MAX_PATH];
+        if (!depth) {
+            if (strcmp(de->d_name, ".") != 0 && strcmp(de->d_name, "..") != 0) fn(de->d_name, arg);
+        } else if (is_fanout_dir(de->d_name) && snprintf(path, sizeof(path), "%s/%s", dir, de->d_name) < (int)sizeof(path)) {
+            fanout_walk(path, depth - 1, fn, arg);
         }
-        if (n == 0) break; // connection closed
-        recvd += (size_t)n;
     }
-    return (ssize_t)recvd;
+    closedir(d);
 }
 
-// Read a line ending with '\n' (up to MAX_LINE-1). Returns bytes read, 0 on EOF, -1 on error.
-static ssize_t recv_line(int fd, char *out, size_t cap) {
-    size_t i = 0;
-    while (i + 1 < cap) {
-        char c;
-        ssize_t n = recv(fd, &c, 1, 0);
-        if (n < 0) {
-            if (errno == EINTR) continue;
-            return -1;
+static meta_entry_t *entry_new(const char *name, int level) {
+    size_t len = strlen(name) + 1;
+    size_t links = sizeof(meta_entry_t *) * (size_t)level;
+    meta_entry_t *e = (meta_entry_t *)calloc(1, sizeof(meta_entry_t) + links + len);
+    if (!e) return NULL;
+    e->level = level;
+    e->name = (char *)e->fwd + links;
+    memcpy(e->name, name, len);
+    return e;
+}
+
+// Caller holds the write lock (the seed is shared state).
+static int skip_random_level(void) {
+    int level = 1;
+    uint32_t x = catalog.seed;
+    x ^= x << 13; x ^= x >> 17; x ^= x << 5; // xorshift32
+    catalog.seed = x;
+    while ((x & 3) == 0 && level < SKIP_MAX_LEVEL) { // p = 1/4
+        level++;
+        x >>= 2;
+    }
+    return level;
+}
+
+// Fill update[] with the last node before `name` on every level.
+static void skip_path(const char *name, meta_entry_t **update) {
+    meta_entry_t *x = catalog.head;
+    for (int i = catalog.level - 1; i >= 0; i--) {
+        while (x->fwd[i] && strcmp(x->fwd[i]->name, name) < 0) x = x->fwd[i];
+        update[i] = x;
+    }
+}
+
+// First entry whose name is >= key (inclusive) or > key. Caller holds the lock.
+static meta_entry_t *skip_seek(const char *key, bool inclusive) {
+    meta_entry_t *x = catalog.head;
+    for (int i = catalog.level - 1; i >= 0; i--) {
+        while (x->fwd[i]) {
+            int cmp = strcmp(x->fwd[i]->name, key);
+            if (cmp < 0 || (cmp == 0 && !inclusive)) x = x->fwd[i];
+            else break;
         }
-        if (n == 0) { // peer closed
-            if (i == 0) return 0;
-            break;
+    }
+    return x->fwd[0];
+}
+
+// Caller holds the lock. Returns the link pointing at `name`'s entry (or at NULL).
+static meta_entry_t **catalog_slot(const char *name) {
+    meta_entry_t **pp = &catalog.buckets[name_hash(name) & (catalog.nbuckets - 1)];
+    while (*pp && strcmp((*pp)->name, name) != 0) pp = &(*pp)->next;
+    return pp;
+}
+
+static void catalog_grow(void) {
+    size_t n = catalog.nbuckets ? catalog.nbuckets * 2 : 1024;
+    meta_entry_t **b = (meta_entry_t **)calloc(n, sizeof(meta_entry_t *));
+    if (!b) return; // keep the old table, chains just get longer
+    for (size_t i = 0; i < catalog.nbuckets; i++) {
+        meta_entry_t *e = catalog.buckets[i];
+        while (e) {
+            meta_entry_t *next = e->next;
+            meta_entry_t **head = &b[name_hash(e->name) & (n - 1)];
+            e->next = *head;
+            *head = e;
+            e = next;
         }
-        out[i++] = c;
-        if (c == '\n') break;
     }
-    out[i] = '\0';
-    return (ssize_t)i;
+    free(catalog.buckets);
+    catalog.buckets = b;
+    catalog.nbuckets = n;
 }
 
-static int send_line(int fd, const char *fmt, ...) {
-    char buf[MAX_LINE];
-    va_list ap; va_start(ap, fmt);
-    vsnprintf(buf, sizeof(buf), fmt, ap);
-    va_end(ap);
-    size_t len = strlen(buf);
-    return (int)send_all(fd, buf, len);
+// Caller holds the write lock.
+static void catalog_put_locked(const char *name, long long size, time_t mtime, long long crc,
+                               int vol, long long voff) {
+    if (catalog.count >= catalog.nbuckets) catalog_grow();
+    meta_entry_t **pp = catalog_slot(name);
+    if (!*pp) {
+        meta_entry_t *e = entry_new(name, skip_random_level());
+        if (!e) return;
+        meta_entry_t *update[SKIP_MAX_LEVEL];
+        skip_path(name, update);
+        for (int i = catalog.level; i < e->level; i++) update[i] = catalog.head;
+        if (e->level > catalog.level) catalog.level = e->level;
+        for (int i = 0; i < e->level; i++) {
+            e->fwd[i] = update[i]->fwd[i];
+            update[i]->fwd[i] = e;
+        }
+        *pp = e;
+        catalog.count++;
+    }
+    (*pp)->size = size;
+    (*pp)->mtime = mtime;
+    (*pp)->crc = crc;
+    (*pp)->vol = vol;
+    (*pp)->voff = voff;
+}
+
+// Caller holds the write lock. Unlinks `name` from both structures.
+static meta_entry_t *catalog_unlink_locked(const char *name) {
+    meta_entry_t **pp = catalog_slot(name);
+    meta_entry_t *e = *pp;
+    if (!e) return NULL;
+    *pp = e->next;
+    meta_entry_t *update[SKIP_MAX_LEVEL];
+    skip_path(name, update);
+    for (int i = 0; i < e->level; i++) update[i]->fwd[i] = e->fwd[i];
+    while (catalog.level > 1 && !catalog.head->fwd[catalog.level - 1]) catalog.level--;
+    catalog.count--;
+    return e;
+}
+
+// Caller holds the lock.
+static meta_entry_t *catalog_find(const char *name) {
+    return catalog.nbuckets ? *catalog_slot(name) : NULL;
+}
+
+static void catalog_put(const char *name, long long size, time_t mtime, long long crc) {
+    pthread_rwlock_wrlock(&catalog.lock);
+    catalog_put_locked(name, size, mtime, crc, -1, 0);
+    pthread_rwlock_unlock(&catalog.lock);
+}
+
+static void catalog_remove(const char *name) {
+    pthread_rwlock_wrlock(&catalog.lock);
+    free(catalog_unlink_locked(name));
+    pthread_rwlock_unlock(&catalog.lock);
+}
+
+static void catalog_rename(const char *oldn, const char *newn) {
+    pthread_rwlock_wrlock(&catalog.lock);
+    meta_entry_t *e = catalog_unlink_locked(oldn);
+    if (e) {
+        catalog_put_locked(newn, e->size, e->mtime, e->crc, -1, 0);
+        free(e);
+    }
+    pthread_rwlock_unlock(&catalog.lock);
+}
+
+// Per-name write exclusion for operations that replace objects (publish,
+// RENAME, DELETE): a fixed table of rwlocks indexed by the name's hash, so
+// writers of different names rarely share a lock and no syscall is needed.
+// Reads take the read side only to pin a chunked version (object_open_read());
+// a flat object is only ever replaced by rename, so an open descriptor keeps
+// one complete version without any lock. With --shared-dir, write holds also
+// take an OFD lock on the shard's byte of META_DIR/locks to exclude the other
+// server processes using the same directory.
+#define NAME_LOCK_SHARDS 256
+
+typedef struct {
+    pthread_rwlock_t lock;
+} __attribute__((aligned(64))) name_lock_shard_t;
+
+static name_lock_shard_t name_locks[NAME_LOCK_SHARDS];
+static int name_lock_fd = -1;   // META_DIR/locks, --shared-dir only
+
+typedef struct {
+    unsigned shard[2];
+    int n;
+    bool write;
+} name_lock_t;
+
+static void name_locks_init(const char *storage_dir, bool shared) {
+    for (int i = 0; i < NAME_LOCK_SHARDS; i++) pthread_rwlock_init(&name_locks[i].lock, NULL);
+    if (!shared) return;
+    char path[MAX_PATH];
+    snprintf(path, sizeof(path), "%s/" META_DIR "/locks", storage_dir);
+    name_lock_fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+    if (name_lock_fd < 0) die("Failed to open %s", path);
+}
+
+static int ofd_lock(int fd, off_t start, short type) {
+    struct flock fl;
+    memset(&fl, 0, sizeof(fl));
+    fl.l_type = type;   // F_RDLCK, F_WRLCK or F_UNLCK
+    fl.l_whence = SEEK_SET;
+    fl.l_start = start;
+    fl.l_len = 1;
+    int r;
+    while ((r = fcntl(fd, F_OFD_SETLKW, &fl)) < 0 && errno == EINTR) {}
+    return r;
+}
+
+// Lock the shards of `a` and `b` (b may be NULL) in ascending order, so two
+// RENAMEs of the same pair can't deadlock. Only one thread of this process
+// write-holds a shard at a time, which makes the single shared OFD safe.
+static void name_lock(name_lock_t *l, const char *a, const char *b, bool write) {
+    unsigned s0 = (unsigned)(name_hash(a) % NAME_LOCK_SHARDS);
+    unsigned s1 = b ? (unsigned)(name_hash(b) % NAME_LOCK_SHARDS) : s0;
+    l->shard[0] = s0 < s1 ? s0 : s1;
+    l->shard[1] = s0 < s1 ? s1 : s0;
+    l->n = (s0 == s1) ? 1 : 2;
+    l->write = write;
+    for (int i = 0; i < l->n; i++) {
+        pthread_rwlock_t *rw = &name_locks[l->shard[i]].lock;
+        if (write) pthread_rwlock_wrlock(rw);
+        else pthread_rwlock_rdlock(rw);
+        if (write && name_lock_fd >= 0 && ofd_lock(name_lock_fd, l->shard[i], F_WRLCK) < 0) {
+            perror("OFD lock"); // still excluded within this process
+        }
+    }
+}
+
+static void name_unlock(name_lock_t *l) {
+    for (int i = l->n - 1; i >= 0; i--) {
+        if (l->write && name_lock_fd >= 0) ofd_lock(name_lock_fd, l->shard[i], F_UNLCK);
+        pthread_rwlock_unlock(&name_locks[l->shard[i]].lock);
+    }
+}
+
+// CRC32C object checksums (crc32c.c). crc32c(0, ...) starts a checksum and
+// crc32c(prev, ...) continues one.
+#define CRC_XATTR "user.mcs.crc32c"
+
+// The checksum is kept in an xattr of the object file, so it moves with
+// rename() and goes away with unlink(). Pass a path, or NULL and an fd.
+static long long crc_xattr_get(const char *path, int fd) {
+    char hex[16];
+    ssize_t n = path ? getxattr(path, CRC_XATTR, hex, sizeof(hex) - 1)
+                     : fgetxattr(fd, CRC_XATTR, hex, sizeof(hex) - 1);
+    if (n <= 0) return -1;
+    hex[n] = '\0';
+    char *end;
+    unsigned long v = strtoul(hex, &end, 16);
+    return (*end == '\0') ? (long long)(uint32_t)v : -1;
+}
+
+static void crc_xattr_set(int fd, uint32_t crc) {
+    char hex[16];
+    int n = snprintf(hex, sizeof(hex), "%08x", crc);
+    if (fsetxattr(fd, CRC_XATTR, hex, (size_t)n, 0) < 0) { /* no xattrs here: checksum lives in memory only */ }
+}
+
+// Throughput of crc32c() against memcpy() on a buffer well beyond the caches.
+static void crc32c_bench(void) {
+    const size_t len = (size_t)256 << 20;
+    char *a = (char *)malloc(len), *b = (char *)malloc(len);
+    if (!a || !b) die("out of memory");
+    for (size_t i = 0; i < len; i++) a[i] = (char)(i * 2654435761u >> 13);
+    void *(*volatile copy)(void *, const void *, size_t) = memcpy; // not elided
+    copy(b, a, len); // fault the pages in
+    for (int pass = 0; pass < 3; pass++) {
+        struct timespec t0, t1;
+        uint32_t crc = 0;
+        clock_gettime(CLOCK_MONOTONIC, &t0);
+        for (int r = 0; r < 4; r++) {
+            if (pass == 0) copy(b, a, len);
+            else if (pass == 1) crc = crc32c(crc, a, len);
+            else crc = crc32c_sw(crc, (const uint8_t *)a, len);
+        }
+        clock_gettime(CLOCK_MONOTONIC, &t1);
+        double secs = (double)(t1.tv_sec - t0.tv_sec) + (double)(t1.tv_nsec - t0.tv_nsec) / 1e9;
+        const char *what[] = { "memcpy", crc32c_has_hw ? "crc32c (sse4.2)" : "crc32c", "crc32c (table)" };
+        printf("%-16s %6.2f GB/s  %08x\n", what[pass], 4.0 * (double)len / secs / 1e9, crc);
+    }
+    free(a);
+    free(b);
+}
+
+// Content-defined chunk store (--dedup). Upload bodies are cut into chunks at
+// content-defined boundaries (FastCDC: a gear rolling hash, normalized between
+// CHUNK_MIN and CHUNK_MAX around CHUNK_AVG), so an insert or edit only changes
+// the chunks around it. Each chunk is stored once, named by its SHA-256, under
+// META_DIR/chunks/xx/; the object file itself becomes a text manifest:
+//   MCS-MANIFEST 1 <size> <nchunks>
+//   <sha256-hex> <length>          (one line per chunk, in order)
+// Reference counts live in memory, rebuilt from the manifests at startup
+// (which also removes chunks nothing references). A chunk whose count drops to
+// zero is unlinked once no manifest download is in progress.
+#define CHUNK_MIN (16 * 1024)
+#define CHUNK_AVG (64 * 1024)
+#define CHUNK_MAX (256 * 1024)
+#define CHUNK_MASK_S 0xffffc00000000000ULL  // 18 bits: cuts rarer below CHUNK_AVG
+#define CHUNK_MASK_L 0xfffc000000000000ULL  // 14 bits: cuts likelier above it
+#define MANIFEST_MAGIC "MCS-MANIFEST "
+#define DIGEST_LEN 32
+
+typedef struct {
+    uint32_t h[8];
+    uint64_t len;
+    uint8_t buf[64];
+    size_t n;
+} sha256_t;
+
+static const uint32_t sha256_k[64] = {
+    0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+    0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+    0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+    0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+    0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+    0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+    0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+    0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2
+};
+
+#define ROR32(x, r) (((x) >> (r)) | ((x) << (32 - (r))))
+
+static void sha256_block(sha256_t *s, const uint8_t *p) {
+    uint32_t w[64];
+    for (int i = 0; i < 16; i++) {
+        w[i] = (uint32_t)p[4 * i] << 24 | (uint32_t)p[4 * i + 1] << 16 | (uint32_t)p[4 * i + 2] << 8 | p[4 * i + 3];
+    }
+    for (int i = 16; i < 64; i++) {
+        uint32_t s0 = ROR32(w[i - 15], 7) ^ ROR32(w[i - 15], 18) ^ (w[i - 15] >> 3);
+        uint32_t s1 = ROR32(w[i - 2], 17) ^ ROR32(w[i - 2], 19) ^ (w[i - 2] >> 10);
+        w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+    }
+    uint32_t a = s->h[0], b = s->h[1], c = s->h[2], d = s->h[3];
+    uint32_t e = s->h[4], f = s->h[5], g = s->h[6], h = s->h[7];
+    for (int i = 0; i < 64; i++) {
+        uint32_t t1 = h + (ROR32(e, 6) ^ ROR32(e, 11) ^ ROR32(e, 25)) + ((e & f) ^ (~e & g)) + sha256_k[i] + w[i];
+        uint32_t t2 = (ROR32(a, 2) ^ ROR32(a, 13) ^ ROR32(a, 22)) + ((a & b) ^ (a & c) ^ (b & c));
+        h = g; g = f; f = e; e = d + t1;
+        d = c; c = b; b = a; a = t1 + t2;
+    }
+    s->h[0] += a; s->h[1] += b; s->h[2] += c; s->h[3] += d;
+    s->h[4] += e; s->h[5] += f; s->h[6] += g; s->h[7] += h;
+}
+
+static void sha256(const void *data, size_t len, uint8_t out[DIGEST_LEN]) {
+    static const uint32_t iv[8] = {
+        0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19
+    };
+    sha256_t s;
+    memcpy(s.h, iv, sizeof(iv));
+    const uint8_t *p = (const uint8_t *)data;
+    size_t left = len;
+    for (; left >= 64; p += 64, left -= 64) sha256_block(&s, p);
+    uint8_t tail[128] = {0};
+    memcpy(tail, p, left);
+    tail[left] = 0x80;
+    size_t tlen = (left < 56) ? 64 : 128;
+    uint64_t bits = (uint64_t)len * 8;
+    for (int i = 0; i < 8; i++) tail[tlen - 1 - i] = (uint8_t)(bits >> (8 * i));
+    sha256_block(&s, tail);
+    if (tlen == 128) sha256_block(&s, tail + 64);
+    for (int i = 0; i < 8; i++) {
+        out[4 * i] = (uint8_t)(s.h[i] >> 24);
+        out[4 * i + 1] = (uint8_t)(s.h[i] >> 16);
+        out[4 * i + 2] = (uint8_t)(s.h[i] >> 8);
+        out[4 * i + 3] = (uint8_t)s.h[i];
+    }
+}
+
+static void digest_hex(const uint8_t *d, char out[2 * DIGEST_LEN + 1]) {
+    static const char hex[] = "0123456789abcdef";
+    for (int i = 0; i < DIGEST_LEN; i++) {
+        out[2 * i] = hex[d[i] >> 4];
+        out[2 * i + 1] = hex[d[i] & 15];
+    }
+    out[2 * DIGEST_LEN] = '\0';
+}
+
+static bool digest_parse(const char *s, uint8_t *d) {
+    for (int i = 0; i < 2 * DIGEST_LEN; i++) {
+        int v = (s[i] >= '0' && s[i] <= '9') ? s[i] - '0' : (s[i] >= 'a' && s[i] <= 'f') ? s[i] - 'a' + 10 : -1;
+        if (v < 0) return false;
+        if (i & 1) d[i / 2] = (uint8_t)(d[i / 2] | v);
+        else d[i / 2] = (uint8_t)(v << 4);
+    }
+    return s[2 * DIGEST_LEN] == '\0' || s[2 * DIGEST_LEN] == ' ' || s[2 * DIGEST_LEN] == '\n';
+}
+
+static uint64_t gear[256];
+
+static void gear_init(void) {
+    uint64_t x = 0x6d63732d67656172ULL; // fixed seed: chunk boundaries must not change across runs
+    for (int i = 0; i < 256; i++) {
+        x += 0x9e3779b97f4a7c15ULL; // splitmix64
+        uint64_t z = x;
+        z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+        z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+        gear[i] = z ^ (z >> 31);
+    }
+}
+
+// Length of the next chunk at the start of p[0..n).
+static size_t fastcdc_cut(const uint8_t *p, size_t n) {
+    if (n <= CHUNK_MIN) return n;
+    size_t normal = (n < CHUNK_AVG) ? n : CHUNK_AVG;
+    size_t max = (n < CHUNK_MAX) ? n : CHUNK_MAX;
+    uint64_t h = 0;
+    size_t i = CHUNK_MIN;
+    for (; i < normal; i++) {
+        h = (h << 1) + gear[p[i]];
+        if (!(h & CHUNK_MASK_S)) return i + 1;
+    }
+    for (; i < max; i++) {
+        h = (h << 1) + gear[p[i]];
+        if (!(h & CHUNK_MASK_L)) return i + 1;
+    }
+    return max;
+}
+
+typedef struct {
+    uint8_t digest[DIGEST_LEN];
+    uint32_t len;
+    long long off;              // offset of the chunk in the object
+} chunk_ref_t;
+
+typedef struct {
+    long long size;
+    chunk_ref_t *chunks;
+    size_t n, cap;
+} manifest_t;
+
+typedef struct chunk_entry {
+    struct chunk_entry *next;
+    uint8_t digest[DIGEST_LEN];
+    uint32_t refs;
+} chunk_entry_t;
+
+typedef struct {
+    pthread_mutex_t mu;
+    chunk_entry_t **buckets;
+    size_t nbuckets, count;
+    const char *dir;            // storage_dir
+} chunk_store_t;
+
+static chunk_store_t chunks = { PTHREAD_MUTEX_INITIALIZER, NULL, 0, 0, NULL };
+static bool dedup = false;
+
+static void chunk_path(char *out, size_t cap, const uint8_t *digest) {
+    char hex[2 * DIGEST_LEN + 1];
+    digest_hex(digest, hex);
+    snprintf(out, cap, "%s/" META_DIR "/chunks/%.2s/%s", chunks.dir, hex, hex);
+}
+
+static chunk_entry_t **chunk_slot_locked(const uint8_t *digest) {
+    static chunk_entry_t *none;
+    if (chunks.nbuckets == 0) return &none;
+    uint64_t h;
+    memcpy(&h, digest, sizeof(h));
+    chunk_entry_t **pp = &chunks.buckets[h % chunks.nbuckets];
+    while (*pp && memcmp((*pp)->digest, digest, DIGEST_LEN) != 0) pp = &(*pp)->next;
+    return pp;
+}
+
+static chunk_entry_t *chunk_insert_locked(const uint8_t *digest) {
+    if (chunks.count >= chunks.nbuckets) {
+        size_t nb = chunks.nbuckets ? chunks.nbuckets * 2 : 1024;
+        chunk_entry_t **b = (chunk_entry_t **)calloc(nb, sizeof(*b));
+        if (!b) return NULL;
+        for (size_t i = 0; i < chunks.nbuckets; i++) {
+            for (chunk_entry_t *e = chunks.buckets[i], *next; e; e = next) {
+                next = e->next;
+                uint64_t h;
+                memcpy(&h, e->digest, sizeof(h));
+                e->next = b[h % nb];
+                b[h % nb] = e;
+            }
+        }
+        free(chunks.buckets);
+        chunks.buckets = b;
+        chunks.nbuckets = nb;
+    }
+    chunk_entry_t *e = (chunk_entry_t *)calloc(1, sizeof(*e));
+    if (!e) return NULL;
+    memcpy(e->digest, digest, DIGEST_LEN);
+    chunk_entry_t **pp = chunk_slot_locked(digest);
+    e->next = *pp;
+    *pp = e;
+    chunks.count++;
+    return e;
+}
+
+// Take a reference on the chunk with this content, storing it if new.
+static int chunk_acquire(const uint8_t *data, size_t len, const uint8_t *digest, bool *added) {
+    *added = false;
+    pthread_mutex_lock(&chunks.mu);
+    chunk_entry_t *e = *chunk_slot_locked(digest);
+    if (e) {
+        e->refs++;
+        pthread_mutex_unlock(&chunks.mu);
+        return 0;
+    }
+    pthread_mutex_unlock(&chunks.mu);
+
+    // Write outside the lock, then publish unless someone else stored it first.
+    static unsigned long seq;
+    char tmp[MAX_PATH], path[MAX_PATH];
+    snprintf(tmp, sizeof(tmp), "%s/" META_DIR "/tmp/chunk-%ld-%lu", chunks.dir, (long)getpid(),
+             __atomic_add_fetch(&seq, 1, __ATOMIC_RELAXED));
+    int fd = open(tmp, O_WRONLY | O_CREAT | O_EXCL, 0644);
+    if (fd < 0) return -1;
+    bool ok = write(fd, data, len) == (ssize_t)len;
+    close(fd);
+    if (!ok) {
+        unlink(tmp);
+        return -1;
+    }
+    chunk_path(path, sizeof(path), digest);
+    pthread_mutex_lock(&chunks.mu);
+    e = *chunk_slot_locked(digest);
+    if (e) {
+        e->refs++;
+        pthread_mutex_unlock(&chunks.mu);
+        unlink(tmp);
+        return 0;
+    }
+    e = chunk_insert_locked(digest);
+    if (!e || rename(tmp, path) < 0) {
+        if (e) {
+            *chunk_slot_locked(digest) = e->next;
+            free(e);
+            chunks.count--;
+        }
+        pthread_mutex_unlock(&chunks.mu);
+        unlink(tmp);
+        return -1;
+    }
+    e->refs = 1;
+    *added = true;
+    pthread_mutex_unlock(&chunks.mu);
+    return 0;
+}
+
+// A chunk is referenced by every manifest listing it, by the upload cutting
+// it and by every reader pinning a version that lists it (chunk_pin()); the
+// file goes with the last reference.
+static void chunk_unref_locked(const uint8_t *digest) {
+    chunk_entry_t **pp = chunk_slot_locked(digest);
+    chunk_entry_t *e = *pp;
+    if (!e || e->refs == 0 || --e->refs > 0) return;
+    char path[MAX_PATH];
+    chunk_path(path, sizeof(path), e->digest);
+    unlink(path);
+    *pp = e->next;
+    free(e);
+    chunks.count--;
+}
+
+static void chunk_release(const manifest_t *m) {
+    pthread_mutex_lock(&chunks.mu);
+    for (size_t i = 0; i < m->n; i++) chunk_unref_locked(m->chunks[i].digest);
+    pthread_mutex_unlock(&chunks.mu);
+}
+
+static void chunk_pin(const manifest_t *m) {
+    pthread_mutex_lock(&chunks.mu);
+    for (size_t i = 0; i < m->n; i++) {
+        chunk_entry_t *e = *chunk_slot_locked(m->chunks[i].digest);
+        if (e) e->refs++;
+    }
+    pthread_mutex_unlock(&chunks.mu);
+}
+
+static void manifest_free(manifest_t *m) {
+    if (!m) return;
+    free(m->chunks);
+    free(m);
+}
+
+static bool manifest_add(manifest_t *m, const uint8_t *digest, uint32_t len) {
+    if (m->n == m->cap) {
+        size_t cap = m->cap ? m->cap * 2 : 64;
+        chunk_ref_t *p = (chunk_ref_t *)realloc(m->chunks, cap * sizeof(*p));
+        if (!p) return false;
+        m->chunks = p;
+        m->cap = cap;
+    }
+    chunk_ref_t *r = &m->chunks[m->n++];
+    memcpy(r->digest, digest, DIGEST_LEN);
+    r->len = len;
+    r->off = m->size;
+    m->size += len;
+    return true;
+}
+
+static bool fd_is_manifest(int fd) {
+    char head[sizeof(MANIFEST_MAGIC) - 1];
+    return pread(fd, head, sizeof(head), 0) == (ssize_t)sizeof(head) &&
+           memcmp(head, MANIFEST_MAGIC, sizeof(head)) == 0;
+}
+
+// Parse the manifest in fd; NULL if it is a plain file or malformed.
+static manifest_t *manifest_read(int fd) {
+    if (!fd_is_manifest(fd)) return NULL;
+    int dfd = dup(fd);
+    FILE *f = (dfd >= 0) ? fdopen(dfd, "r") : NULL;
+    if (!f) {
+        if (dfd >= 0) close(dfd);
+        return NULL;
+    }
+    rewind(f);
+    manifest_t *m = (manifest_t *)calloc(1, sizeof(*m));
+    char line[MAX_LINE];
+    long long size = -1;
+    size_t count = 0;
+    bool ok = m && fgets(line, sizeof(line), f) &&
+              sscanf(line, MANIFEST_MAGIC "1 %lld %zu", &size, &count) == 2;
+    while (ok && m->n < count && fgets(line, sizeof(line), f)) {
+        uint8_t d[DIGEST_LEN];
+        unsigned len;
+        ok = digest_parse(line, d) && sscanf(line + 2 * DIGEST_LEN, " %u", &len) == 1 && manifest_add(m, d, len);
+    }
+    fclose(f);
+    if (!ok || m->n != count || m->size != size) {
+        manifest_free(m);
+        return NULL;
+    }
+    return m;
+}
+
+// Keep only the chunks holding bytes of [off, end).
+static void manifest_trim(manifest_t *m, long long off, long long end) {
+    size_t lo = 0, hi = 0;
+    while (lo < m->n && m->chunks[lo].off + (long long)m->chunks[lo].len <= off) lo++;
+    for (hi = lo; hi < m->n && m->chunks[hi].off < end; hi++) {}
+    memmove(m->chunks, m->chunks + lo, (hi - lo) * sizeof(*m->chunks));
+    m->n = hi - lo;
+}
+
+// Open the object `name` at `path` for reading. Flat and packed objects need
+// nothing more: publishing replaces the name, never the file. A chunked one is
+// returned in *man, trimmed to the `len` bytes at `off` (-1: to the end), with
+// those chunks pinned until chunk_release(), so the version stays readable
+// after it is overwritten. The name's read lock is held just long enough to
+// pin, which object_replace() would otherwise race with.
+static int object_open_read(const char *path, const char *name, long long off, long long len,
+                            manifest_t **man) {
+    bool locked = __atomic_load_n(&chunks.count, __ATOMIC_RELAXED) != 0;
+    for (;;) {
+        name_lock_t nl;
+        if (locked) name_lock(&nl, name, NULL, false);
+        int fd = open(path, O_RDONLY);
+        *man = (fd >= 0) ? manifest_read(fd) : NULL;
+        if (*man && !locked) {
+            // The chunk store filled up since the check: pin under the lock.
+            manifest_free(*man);
+            close(fd);
+            locked = true;
+            continue;
+        }
+        if (*man) {
+            long long size = (*man)->size;
+            manifest_trim(*man, off, (len < 0 || len > size - off) ? size : off + len);
+            chunk_pin(*man);
+        }
+        if (locked) name_unlock(&nl);
+        return fd;
+    }
+}
+
+static manifest_t *manifest_load(const char *path) {
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) return NULL;
+    manifest_t *m = manifest_read(fd);
+    close(fd);
+    return m;
+}
+
+static bool manifest_write(int fd, const manifest_t *m) {
+    FILE *f = fdopen(dup(fd), "w");
+    if (!f) return false;
+    fprintf(f, MANIFEST_MAGIC "1 %lld %zu\n", m->size, m->n);
+    for (size_t i = 0; i < m->n; i++) {
+        char hex[2 * DIGEST_LEN + 1];
+        digest_hex(m->chunks[i].digest, hex);
+        fprintf(f, "%s %u\n", hex, (unsigned)m->chunks[i].len);
+    }
+    return fclose(f) == 0;
+}
+
+// Streaming chunker: bytes are buffered until a full CHUNK_MAX window is
+// available (or the body ends), so cut points don't depend on how the body
+// was split across recv() calls.
+typedef struct {
+    uint8_t *buf;               // 2 * CHUNK_MAX
+    size_t len;
+    manifest_t man;             // chunks cut so far, each holding a reference
+    int new_chunks;             // chunks this upload added to the store
+} chunker_t;
+
+static chunker_t *chunker_new(void) {
+    chunker_t *ck = (chunker_t *)calloc(1, sizeof(*ck));
+    if (ck) ck->buf = (uint8_t *)malloc(2 * CHUNK_MAX);
+    if (ck && !ck->buf) {
+        free(ck);
+        ck = NULL;
+    }
+    return ck;
+}
+
+static bool chunker_emit(chunker_t *ck, const uint8_t *p, size_t len) {
+    uint8_t digest[DIGEST_LEN];
+    bool added;
+    sha256(p, len, digest);
+    if (chunk_acquire(p, len, digest, &added) < 0) return false;
+    if (!manifest_add(&ck->man, digest, (uint32_t)len)) {
+        pthread_mutex_lock(&chunks.mu);
+        chunk_unref_locked(digest);
+        pthread_mutex_unlock(&chunks.mu);
+        return false;
+    }
+    if (added) ck->new_chunks++;
+    return true;
+}
+
+// Cut chunks while at least `keep` bytes remain buffered.
+static bool chunker_cut(chunker_t *ck, size_t keep) {
+    size_t pos = 0;
+    while (ck->len - pos > keep || (keep == 0 && pos < ck->len)) {
+        size_t n = fastcdc_cut(ck->buf + pos, ck->len - pos);
+        if (!chunker_emit(ck, ck->buf + pos, n)) return false;
+        pos += n;
+    }
+    memmove(ck->buf, ck->buf + pos, ck->len - pos);
+    ck->len -= pos;
+    return true;
+}
+
+static bool chunker_feed(chunker_t *ck, const void *data, size_t n) {
+    const uint8_t *p = (const uint8_t *)data;
+    while (n > 0) {
+        size_t take = 2 * CHUNK_MAX - ck->len;
+        if (take > n) take = n;
+        memcpy(ck->buf + ck->len, p, take);
+        ck->len += take;
+        p += take;
+        n -= take;
+        if (ck->len == 2 * CHUNK_MAX && !chunker_cut(ck, CHUNK_MAX - 1)) return false;
+    }
+    return true;
+}
+
+static bool chunker_finish(chunker_t *ck) {
+    return chunker_cut(ck, 0);
+}
+
+// Free the chunker; with `release` its references go too (failed upload).
+static void chunker_free(chunker_t *ck, bool release) {
+    if (!ck) return;
+    if (release) chunk_release(&ck->man);
+    free(ck->man.chunks);
+    free(ck->buf);
+    free(ck);
+}
+
+static void chunks_prepare(const char *storage_dir) {
+    char path[MAX_PATH];
+    chunks.dir = storage_dir;
+    gear_init();
+    snprintf(path, sizeof(path), "%s/" META_DIR "/chunks", storage_dir);
+    if (mkdir(path, 0755) < 0 && errno != EEXIST) die("Failed to create %s", path);
+    for (int i = 0; i < 256; i++) {
+        snprintf(path, sizeof(path), "%s/" META_DIR "/chunks/%02x", storage_dir, i);
+        if (mkdir(path, 0755) < 0 && errno != EEXIST) die("Failed to create %s", path);
+    }
+}
+
+// Count the references of one manifest found at startup.
+static void chunks_load_manifest(const manifest_t *m) {
+    for (size_t i = 0; i < m->n; i++) {
+        chunk_entry_t *e = *chunk_slot_locked(m->chunks[i].digest);
+        if (!e) e = chunk_insert_locked(m->chunks[i].digest);
+        if (!e) die("out of memory");
+        e->refs++;
+    }
+}
+
+// After all manifests are counted: drop chunk files nothing references
+// (left by a crash between storing chunks and publishing the manifest).
+static void chunks_sweep(void) {
+    for (int i = 0; i < 256; i++) {
+        char dir[MAX_PATH];
+        snprintf(dir, sizeof(dir), "%s/" META_DIR "/chunks/%02x", chunks.dir, i);
+        DIR *d = opendir(dir);
+        if (!d) continue;
+        struct dirent *de;
+        while ((de = readdir(d)) != NULL) {
+            if (de->d_name[0] == '.') continue;
+            uint8_t digest[DIGEST_LEN];
+            if (strlen(de->d_name) == 2 * DIGEST_LEN && digest_parse(de->d_name, digest) &&
+                *chunk_slot_locked(digest)) continue;
+            char p[MAX_PATH];
+            if (snprintf(p, sizeof(p), "%s/%s", dir, de->d_name) < (int)sizeof(p)) unlink(p);
+        }
+        closedir(d);
+    }
+}
+
+// Compressed-at-rest objects (--compress). The body is cut into PACK_BLOCK
+// blocks, each LZ4 compressed on its own (kept raw when that doesn't shrink
+// it), behind a fixed-size header and an index of stored lengths:
+//   "MCS-PACKED 1 <size> <nblocks>" padded with spaces to PACK_HDR bytes
+//   <nblocks> x 32-bit big-endian stored length
+//   the blocks, in order
+// A range read finds its blocks from the index and decompresses only those;
+// a compressed DOWNLOAD whose frames line up with the blocks sends them as
+// stored. PACK_BLOCK is the wire frame size for that reason.
+#define PACK_MAGIC "MCS-PACKED "
+#define PACK_HDR 64
+#define PACK_BLOCK ZBLOCK
+
+static bool compress_at_rest = false;
+
+typedef struct {
+    long long size;
+    size_t n;
+    long long *off;             // n + 1 file offsets: block i is off[i]..off[i+1]
+    int fd;                     // not owned
+    size_t cached;              // block decoded in buf, n if none
+    uint8_t *buf;               // PACK_BLOCK bytes
+} packed_t;
+
+static bool fd_is_packed(int fd) {
+    char head[sizeof(PACK_MAGIC) - 1];
+    return pread(fd, head, sizeof(head), 0) == (ssize_t)sizeof(head) &&
+           memcmp(head, PACK_MAGIC, sizeof(head)) == 0;
+}
+
+static void packed_free(packed_t *p) {
+    if (!p) return;
+    free(p->off);
+    free(p->buf);
+    free(p);
+}
+
+// Logical size from the header of a packed object in fd, or -1.
+static long long packed_size(int fd) {
+    char hdr[PACK_HDR + 1];
+    long long size;
+    size_t n;
+    if (pread(fd, hdr, PACK_HDR, 0) != PACK_HDR) return -1;
+    hdr[PACK_HDR] = '\0';
+    if (memcmp(hdr, PACK_MAGIC, sizeof(PACK_MAGIC) - 1) != 0 ||
+        sscanf(hdr, PACK_MAGIC "1 %lld %zu", &size, &n) != 2 || size < 0 ||
+        n != (size_t)((size + PACK_BLOCK - 1) / PACK_BLOCK)) return -1;
+    return size;
+}
+
+// Logical size of the object in fd: from its manifest or packed header, else
+// the file size.
+static long long object_size(int fd, const struct stat *st) {
+    char head[128];
+    long long size;
+    ssize_t n = pread(fd, head, sizeof(head) - 1, 0);
+    head[n > 0 ? n : 0] = '\0';
+    if (n > 0 && sscanf(head, MANIFEST_MAGIC "1 %lld", &size) == 1) return size;
+    size = packed_size(fd);
+    return size >= 0 ? size : (long long)st->st_size;
+}
+
+// Parse the header and index in fd; NULL if it is not a packed object or
+// is malformed. fd must stay open while the result is used.
+static packed_t *packed_read(int fd) {
+    long long size = packed_size(fd);
+    if (size < 0) return NULL;
+    size_t n = (size_t)((size + PACK_BLOCK - 1) / PACK_BLOCK);
+    packed_t *p = (packed_t *)calloc(1, sizeof(*p));
+    uint32_t *len = (uint32_t *)malloc(n * sizeof(uint32_t) + 1);
+    if (p) {
+        p->off = (long long *)malloc((n + 1) * sizeof(long long));
+        p->buf = (uint8_t *)malloc(PACK_BLOCK);
+    }
+    bool ok = p && len && p->off && p->buf &&
+              pread(fd, len, n * sizeof(uint32_t), PACK_HDR) == (ssize_t)(n * sizeof(uint32_t));
+    if (ok) {
+        p->off[0] = PACK_HDR + (long long)(n * sizeof(uint32_t));
+        for (size_t i = 0; i < n; i++) {
+            uint32_t l = ntohl(len[i]);
+            if (l == 0 || l > ZBOUND(PACK_BLOCK)) ok = false;
+            p->off[i + 1] = p->off[i] + l;
+        }
+    }
+    free(len);
+    if (!ok) {
+        packed_free(p);
+        return NULL;
+    }
+    p->size = size;
+    p->n = n;
+    p->fd = fd;
+    p->cached = n;
+    return p;
+}
+
+static size_t packed_raw_len(const packed_t *p, size_t i) {
+    long long rest = p->size - (long long)i * PACK_BLOCK;
+    return (rest < PACK_BLOCK) ? (size_t)rest : PACK_BLOCK;
+}
+
+// Like pread() on the decompressed contents; reads stop at block ends.
+static ssize_t packed_pread(packed_t *p, char *out, size_t n, long long off) {
+    if (off >= p->size) return 0;
+    size_t i = (size_t)(off / PACK_BLOCK), raw = packed_raw_len(p, i);
+    if (p->cached != i) {
+        size_t stored = (size_t)(p->off[i + 1] - p->off[i]);
+        uint8_t *z = (stored == raw) ? p->buf : (uint8_t *)malloc(stored);
+        if (!z) return -1;
+        ssize_t r = pread(p->fd, z, stored, (off_t)p->off[i]);
+        long got = (r != (ssize_t)stored) ? -1
+                 : (z == p->buf) ? (long)raw : lz4_decompress(z, stored, p->buf, PACK_BLOCK);
+        if (z != p->buf) free(z);
+        if (got != (long)raw) {
+            p->cached = p->n;
+            errno = EIO;
+            return -1;
+        }
+        p->cached = i;
+    }
+    size_t skip = (size_t)(off - (long long)i * PACK_BLOCK);
+    if (n > raw - skip) n = raw - skip;
+    memcpy(out, p->buf + skip, n);
+    return (ssize_t)n;
+}
+
+// Writes a packed object of a known size into fd as the body streams in.
+typedef struct {
+    int fd;                     // not owned
+    long long size;
+    size_t n, done;             // blocks in total / written
+    uint32_t *len;              // stored length of each written block
+    long long pos;              // file offset of the next block
+    uint8_t *blk, *z;           // raw block being filled, its compressed form
+    size_t fill;
+} packer_t;
+
+static void packer_free(packer_t *pk) {
+    if (!pk) return;
+    free(pk->len);
+    free(pk->blk);
+    free(pk->z);
+    free(pk);
+}
+
+static packer_t *packer_new(int fd, long long size) {
+    packer_t *pk = (packer_t *)calloc(1, sizeof(*pk));
+    if (!pk) return NULL;
+    pk->fd = fd;
+    pk->size = size;
+    pk->n = (size_t)((size + PACK_BLOCK - 1) / PACK_BLOCK);
+    pk->pos = PACK_HDR + (long long)(pk->n * sizeof(uint32_t));
+    pk->len = (uint32_t *)malloc(pk->n * sizeof(uint32_t) + 1);
+    pk->blk = (uint8_t *)malloc(PACK_BLOCK);
+    pk->z = (uint8_t *)malloc(ZBOUND(PACK_BLOCK));
+    if (!pk->len || !pk->blk || !pk->z) {
+        packer_free(pk);
+        return NULL;
+    }
+    return pk;
+}
+
+static bool packer_flush(packer_t *pk) {
+    if (pk->fill == 0) return true;
+    if (pk->done == pk->n) return false; // more bytes than announced
+    size_t z = lz4_compress(pk->blk, pk->fill, pk->z, pk->fill - 1);
+    const uint8_t *data = z ? pk->z : pk->blk;
+    if (!z) z = pk->fill;
+    if (pwrite(pk->fd, data, z, (off_t)pk->pos) != (ssize_t)z) return false;
+    pk->len[pk->done++] = htonl((uint32_t)z);
+    pk->pos += (long long)z;
+    pk->fill = 0;
+    return true;
+}
+
+static bool packer_feed(packer_t *pk, const void *buf, size_t n) {
+    const uint8_t *p = (const uint8_t *)buf;
+    while (n > 0) {
+        size_t take = PACK_BLOCK - pk->fill;
+        if (take > n) take = n;
+        memcpy(pk->blk + pk->fill, p, take);
+        pk->fill += take;
+        p += take;
+        n -= take;
+        if (pk->fill == PACK_BLOCK && !packer_flush(pk)) return false;
+    }
+    return true;
+}
+
+// Last block, then the index and header in front of the blocks.
+static bool packer_finish(packer_t *pk) {
+    char hdr[PACK_HDR], line[PACK_HDR];
+    if (!packer_flush(pk) || pk->done != pk->n) return false;
+    int h = snprintf(line, sizeof(line), PACK_MAGIC "1 %lld %zu", pk->size, pk->n);
+    memset(hdr, ' ', PACK_HDR);
+    memcpy(hdr, line, (size_t)h);
+    hdr[PACK_HDR - 1] = '\n';
+    size_t ilen = pk->n * sizeof(uint32_t);
+    return pwrite(pk->fd, pk->len, ilen, PACK_HDR) == (ssize_t)ilen &&
+           pwrite(pk->fd, hdr, PACK_HDR, 0) == PACK_HDR;
+}
+
+// Upload sessions live in META_DIR/sessions as <id> (bytes received so far)
+// and <id>.info ("<size> <name>"). They survive restarts; sessions idle for
+// SESSION_TTL, and data files whose .info is gone, are removed here.
+static void sessions_sweep(const char *dir) {
+    DIR *d = opendir(dir);
+    if (!d) return;
+    time_t now = time(NULL);
+    struct dirent *de;
+    while ((de = readdir(d)) != NULL) {
+        if (de->d_name[0] == '.' || strchr(de->d_name, '.')) continue;
+        char data[MAX_PATH], info[MAX_PATH], gaps[MAX_PATH];
+        if (snprintf(data, sizeof(data), "%s/%s", dir, de->d_name) >= (int)sizeof(data) ||
+            snprintf(info, sizeof(info), "%s.info", data) >= (int)sizeof(info) ||
+            snprintf(gaps, sizeof(gaps), "%s.gaps", data) >= (int)sizeof(gaps)) continue;
+        struct stat st;
+        if (access(info, F_OK) < 0 || (stat(data, &st) == 0 && now - st.st_mtime > SESSION_TTL)) {
+            unlink(gaps);
+            unlink(data);
+            unlink(info);
+        }
+    }
+    closedir(d);
+}
+
+// Create the META_DIR layout and drop temp files left by uploads interrupted
+// by a crash.
+static void prepare_storage(const char *storage_dir) {
+    char path[MAX_PATH];
+    snprintf(path, sizeof(path), "%s/" META_DIR, storage_dir);
+    if (mkdir(path, 0755) < 0 && errno != EEXIST) die("Failed to create %s", path);
+    snprintf(path, sizeof(path), "%s/" META_DIR "/sessions", storage_dir);
+    if (mkdir(path, 0755) < 0 && errno != EEXIST) die("Failed to create %s", path);
+    sessions_sweep(path);
+    chunks_prepare(storage_dir);
+    snprintf(path, sizeof(path), "%s/" META_DIR "/tmp", storage_dir);
+    if (mkdir(path, 0755) < 0 && errno != EEXIST) die("Failed to create %s", path);
+    DIR *d = opendir(path);
+    if (!d) return;
+    struct dirent *de;
+    while ((de = readdir(d)) != NULL) {
+        if (de->d_name[0] == '.') continue;
+        char p[MAX_PATH];
+        if (snprintf(p, sizeof(p), "%s/%s", path, de->d_name) < (int)sizeof(p)) unlink(p);
+    }
+    closedir(d);
+}
+
+// Object versions. With --versions/--version-days, whatever an UPLOAD, RENAME
+// or DELETE replaces is first hardlinked to META_DIR/versions/xx/yy/<name>/<id>
+// (fanned out like the objects), so
+// keeping it costs a link, not a copy (a chunked version keeps its chunk
+// references instead). The id is the time it was replaced, in microseconds.
+// Retention is applied by the pruner thread, never by the request.
+#define PRUNE_INTERVAL 60       // seconds between --version-days sweeps
+
+typedef struct prune_name {
+    struct prune_name *next;
+    char name[];
+} prune_name_t;
+
+typedef struct {
+    pthread_mutex_t mu;
+    pthread_cond_t wake;
+    prune_name_t *head;         // names that gained a version since the last pass
+    bool enabled;
+    int keep;                   // versions kept per object, 0: no limit
+    long days;                  // drop versions older than this, 0: never
+    char dir[MAX_PATH];         // META_DIR/versions
+} versions_t;
+
+static versions_t versions = { PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER, NULL, false, 0, 0, "" };
+
+static bool version_path(char *out, size_t cap, const char *name, unsigned long long id) {
+    if (!fanout_path(out, cap, versions.dir, name)) return false;
+    size_t len = strlen(out);
+    int r = id ? snprintf(out + len, cap - len, "/%llu", id) : 0;
+    return r >= 0 && (size_t)r < cap - len;
+}
+
+// Create name's version directory.
+static bool version_mkdir(const char *name) {
+    char dir[MAX_PATH];
+    return version_path(dir, sizeof(dir), name, 0) && fanout_dirs(dir) && (mkdir(dir, 0755) == 0 || errno == EEXIST);
+}
+
+// Split "<name>@<id>" as accepted by DOWNLOAD.
+static bool version_split(const char *s, char *name, size_t cap, unsigned long long *id) {
+    const char *at = strrchr(s, '@');
+    if (!at || at == s || (size_t)(at - s) >= cap || !at[1]) return false;
+    for (const char *p = at + 1; *p; p++) {
+        if (*p < '0' || *p > '9') return false;
+    }
+    memcpy(name, s, (size_t)(at - s));
+    name[at - s] = '\0';
+    *id = strtoull(at + 1, NULL, 10);
+    return *id != 0;
+}
+
+static unsigned long long now_us(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    return (unsigned long long)ts.tv_sec * 1000000ULL + (unsigned long long)ts.tv_nsec / 1000;
+}
+
+// Hardlink the object at `path` as a new version of `name`; out gets its path.
+// The caller write-holds the name lock.
+static bool version_keep(const char *path, const char *name, char *out, size_t cap) {
+    if (!versions.enabled) return false;
+    unsigned long long id = now_us();
+    bool made_dir = false;
+    for (;;) {
+        if (!version_path(out, cap, name, id)) return false;
+        if (link(path, out) == 0) return true;
+        if (errno == EEXIST) {
+            id++;
+            continue;
+        }
+        if (errno != ENOENT || made_dir || access(path, F_OK) < 0 || !version_mkdir(name)) return false;
+        made_dir = true;
+    }
+}
+
+static void version_queue(const char *name) {
+    pthread_mutex_lock(&versions.mu);
+    prune_name_t *p = versions.head;
+    while (p && strcmp(p->name, name) != 0) p = p->next;
+    size_t len = strlen(name) + 1;
+    if (!p && (p = (prune_name_t *)malloc(sizeof(*p) + len)) != NULL) {
+        memcpy(p->name, name, len);
+        p->next = versions.head;
+        versions.head = p;
+        pthread_cond_signal(&versions.wake);
+    }
+    pthread_mutex_unlock(&versions.mu);
+}
+
+static int id_cmp(const void *a, const void *b) {
+    unsigned long long x = *(const unsigned long long *)a, y = *(const unsigned long long *)b;
+    return (x > y) - (x < y);
+}
+
+// Ids of name's versions, oldest first; NULL (and n = 0) if none.
+static unsigned long long *version_ids(const char *name, size_t *n) {
+    char dir[MAX_PATH];
+    unsigned long long *ids = NULL;
+    size_t cap = 0;
+    *n = 0;
+    DIR *d = version_path(dir, sizeof(dir), name, 0) ? opendir(dir) : NULL;
+    if (!d) return NULL;
+    struct dirent *de;
+    while ((de = readdir(d)) != NULL) {
+        unsigned long long id;
+        char tail;
+        if (sscanf(de->d_name, "%llu%c", &id, &tail) != 1 || id == 0) continue;
+        if (*n == cap) {
+            cap = cap ? cap * 2 : 16;
+            unsigned long long *grown = (unsigned long long *)realloc(ids, cap * sizeof(*ids));
+            if (!grown) break;
+            ids = grown;
+        }
+        ids[(*n)++] = id;
+    }
+    closedir(d);
+    if (ids) qsort(ids, *n, sizeof(*ids), id_cmp);
+    return ids;
+}
+
+// Apply retention to one object's versions.
+static void versions_prune(const char *name) {
+    size_t n;
+    name_lock_t nl;
+    name_lock(&nl, name, NULL, true);
+    unsigned long long *ids = version_ids(name, &n);
+    unsigned long long cutoff = versions.days ? now_us() - (unsigned long long)versions.days * 86400000000ULL : 0;
+    size_t left = n;
+    for (size_t i = 0; i < n; i++) {
+        if (!(versions.keep && left > (size_t)versions.keep) && ids[i] >= cutoff) continue;
+        char path[MAX_PATH];
+        if (!version_path(path, sizeof(path), name, ids[i])) continue;
+        manifest_t *m = manifest_load(path);
+        if (unlink(path) == 0) {
+            left--;
+            if (m) chunk_release(m);
+        }
+        manifest_free(m);
+    }
+    char dir[MAX_PATH];
+    if (left == 0 && version_path(dir, sizeof(dir), name, 0)) rmdir(dir);
+    name_unlock(&nl);
+    free(ids);
+}
+
+static void versions_prune_one(const char *name, void *arg) {
+    (void)arg;
+    versions_prune(name);
+}
+
+static void versions_sweep(void) {
+    fanout_walk(versions.dir, 2, versions_prune_one, NULL);
+}
+
+// Prunes the objects that gained a version as they come in, and everything
+// at startup and every PRUNE_INTERVAL (for --version-days).
+static void *prune_thread(void *arg) {
+    (void)arg;
+    bool swept = false;
+    time_t next_sweep = 0;
+    pthread_mutex_lock(&versions.mu);
+    for (;;) {
+        while (!versions.head && swept && (!versions.days || time(NULL) < next_sweep)) {
+            struct timespec ts = { next_sweep, 0 };
+            if (versions.days) pthread_cond_timedwait(&versions.wake, &versions.mu, &ts);
+            else pthread_cond_wait(&versions.wake, &versions.mu);
+        }
+        prune_name_t *p = versions.head;
+        versions.head = NULL;
+        pthread_mutex_unlock(&versions.mu);
+        while (p) {
+            prune_name_t *next = p->next;
+            versions_prune(p->name);
+            free(p);
+            p = next;
+        }
+        if (!swept || (versions.days && time(NULL) >= next_sweep)) {
+            versions_sweep();
+            swept = true;
+            next_sweep = time(NULL) + PRUNE_INTERVAL;
+        }
+        pthread_mutex_lock(&versions.mu);
+    }
+    return NULL;
+}
+
+// Startup: move the version directories of the flat layout,
+// META_DIR/versions/<name>/, into the fan-out. A name may look like a fan-out
+// directory, so the fanned-out tree is marked (.fanout) and an unmarked one
+// is set aside as versions.flat and drained from there, again after a crash.
+static void versions_migrate(const char *storage_dir) {
+    char flat[MAX_PATH], mark[MAX_PATH];
+    snprintf(flat, sizeof(flat), "%s/" META_DIR "/versions.flat", storage_dir);
+    if (snprintf(mark, sizeof(mark), "%s/.fanout", versions.dir) >= (int)sizeof(mark)) die("Path too long: %s", versions.dir);
+    if (access(mark, F_OK) < 0 && access(flat, F_OK) < 0 && rename(versions.dir, flat) < 0 && errno != ENOENT)
+        die("Failed to move %s", versions.dir);
+    if (mkdir(versions.dir, 0755) < 0 && errno != EEXIST) die("Failed to create %s", versions.dir);
+    int fd = open(mark, O_WRONLY | O_CREAT | O_CLOEXEC, 0644);
+    if (fd < 0) die("Failed to create %s", mark);
+    close(fd);
+    DIR *d = opendir(flat);
+    if (!d) return;
+    struct dirent *de;
+    while ((de = readdir(d)) != NULL) {
+        char from[MAX_PATH], to[MAX_PATH];
+        if (!strcmp(de->d_name, ".") || !strcmp(de->d_name, "..") ||
+            snprintf(from, sizeof(from), "%s/%s", flat, de->d_name) >= (int)sizeof(from) ||
+            !version_path(to, sizeof(to), de->d_name, 0)) continue;
+        if ((!fanout_dirs(to) || rename(from, to) < 0) && errno != ENOENT) die("Failed to move %s", from);
+    }
+    closedir(d);
+    rmdir(flat);
+}
+
+static void version_load_refs(const char *name, void *arg) {
+    (void)arg;
+    size_t n;
+    unsigned long long *ids = version_ids(name, &n);
+    for (size_t i = 0; i < n; i++) {
+        char path[MAX_PATH];
+        manifest_t *m = version_path(path, sizeof(path), name, ids[i]) ? manifest_load(path) : NULL;
+        if (m) chunks_load_manifest(m);
+        manifest_free(m);
+    }
+    free(ids);
+}
+
+// Startup: count the chunk references of chunked versions, like the live
+// manifests catalog_load() counts.
+static void versions_load(const char *storage_dir) {
+    snprintf(versions.dir, sizeof(versions.dir), "%s/" META_DIR "/versions", storage_dir);
+    versions_migrate(storage_dir);
+    fanout_walk(versions.dir, 2, version_load_refs, NULL);
+}
+
+// What the catalog records for the object file at path (the size of the
+// content for a manifest or packed file); false if there is none. With
+// count_chunks, a manifest's chunk references are counted (startup).
+static bool object_stat(const char *path, bool count_chunks, long long *size, time_t *mtime, long long *crc) {
+    struct stat st;
+    if (stat(path, &st) < 0 || !S_ISREG(st.st_mode)) return false;
+    *size = (long long)st.st_size;
+    manifest_t *m = manifest_load(path);
+    if (m) {
+        if (count_chunks) chunks_load_manifest(m);
+        *size = m->size;
+        manifest_free(m);
+    } else {
+        int fd = open(path, O_RDONLY);
+        long long psize = (fd >= 0) ? packed_size(fd) : -1;
+        if (psize >= 0) *size = psize;
+        if (fd >= 0) close(fd);
+    }
+    *mtime = st.st_mtime;
+    *crc = crc_xattr_get(path, -1);
+    return true;
+}
+
+// --shared-dir: refresh name's catalog entry from its file, which another
+// server may have replaced or removed. True if the object exists.
+static bool catalog_sync(const char *storage_dir, const char *name) {
+    char path[MAX_PATH];
+    long long size, crc;
+    time_t mtime;
+    if (!catalog.shared || !object_path(path, sizeof(path), storage_dir, name)) return true;
+    name_lock_t nl;
+    name_lock(&nl, name, NULL, false); // no local publish in between
+    bool found = object_stat(path, false, &size, &mtime, &crc);
+    if (found) catalog_put(name, size, mtime, crc);
+    else catalog_remove(name);
+    name_unlock(&nl);
+    return found;
+}
+
+// --shared-dir: the names the servers publish, so each can add objects it
+// didn't write to its catalog without rescanning the directory.
+// META_DIR/changes holds a sequence number and a ring of CHANGE_SLOTS names,
+// updated under an OFD lock on its first byte. Before a LIST a server syncs
+// the names added since it last looked; one that fell a whole ring behind
+// walks the fan-out once instead.
+#define CHANGE_SLOTS 16384
+#define CHANGE_SLOT 256     // NAME_MAX + 1
+
+static struct {
+    int fd;                     // --shared-dir only
+    unsigned long long seen;    // ring position synced up to
+    pthread_mutex_t mu;         // the OFD lock doesn't exclude this process's threads
+} changes = { -1, 0, PTHREAD_MUTEX_INITIALIZER };
+
+static off_t change_off(unsigned long long seq) {
+    return (off_t)sizeof(seq) + (off_t)(seq % CHANGE_SLOTS) * CHANGE_SLOT;
+}
+
+static unsigned long long changes_seq(void) {
+    unsigned long long seq;
+    return pread(changes.fd, &seq, sizeof(seq), 0) == sizeof(seq) ? seq : 0;
+}
+
+// Before catalog_load(), so names published meanwhile are synced later.
+static void changes_init(const char *storage_dir) {
+    char path[MAX_PATH];
+    snprintf(path, sizeof(path), "%s/" META_DIR "/changes", storage_dir);
+    changes.fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+    if (changes.fd < 0) die("Failed to open %s", path);
+    ofd_lock(changes.fd, 0, F_RDLCK);
+    changes.seen = changes_seq();
+    ofd_lock(changes.fd, 0, F_UNLCK);
+}
+
+// Record a name this server just published. Called after the name lock is
+// dropped: changes_sync() takes name locks while holding changes.mu.
+static void changes_note(const char *name) {
+    if (changes.fd < 0) return;
+    char slot[CHANGE_SLOT] = {0};
+    size_t len = strlen(name);
+    if (len < sizeof(slot)) memcpy(slot, name, len); // else empty: readers rescan
+    pthread_mutex_lock(&changes.mu);
+    if (ofd_lock(changes.fd, 0, F_WRLCK) == 0) {
+        unsigned long long seq = changes_seq(), next = seq + 1;
+        if (pwrite(changes.fd, slot, sizeof(slot), change_off(seq)) != (ssize_t)sizeof(slot) ||
+            pwrite(changes.fd, &next, sizeof(next), 0) != (ssize_t)sizeof(next)) {
+            perror("changes");
+        }
+        ofd_lock(changes.fd, 0, F_UNLCK);
+    }
+    pthread_mutex_unlock(&changes.mu);
+}
+
+static void changes_rescan_one(const char *name, void *arg) {
+    pthread_rwlock_rdlock(&catalog.lock);
+    bool known = catalog_find(name) != NULL;
+    pthread_rwlock_unlock(&catalog.lock);
+    if (!known) catalog_sync((const char *)arg, name);
+}
+
+// Add the names published since the last call to the catalog.
+static void changes_sync(const char *storage_dir) {
+    if (changes.fd < 0) return;
+    pthread_mutex_lock(&changes.mu);
+    if (ofd_lock(changes.fd, 0, F_RDLCK) < 0) {
+        pthread_mutex_unlock(&changes.mu);
+        return;
+    }
+    unsigned long long seq = changes_seq();
+    size_t n = (size_t)(seq - changes.seen);
+    bool rescan = seq - changes.seen > CHANGE_SLOTS; // also a ring that was reset
+    char (*names)[CHANGE_SLOT] = (!rescan && n) ? malloc(n * CHANGE_SLOT) : NULL;
+    if (n && !rescan && !names) rescan = true;
+    for (size_t i = 0; i < n && !rescan;) {
+        size_t at = (size_t)((changes.seen + i) % CHANGE_SLOTS);
+        size_t run = (n - i < CHANGE_SLOTS - at) ? n - i : CHANGE_SLOTS - at;
+        ssize_t want = (ssize_t)(run * CHANGE_SLOT);
+        if (pread(changes.fd, names[i], (size_t)want, change_off(changes.seen + i)) != want) rescan = true;
+        i += run;
+    }
+    ofd_lock(changes.fd, 0, F_UNLCK);
+    for (size_t i = 0; i < n && !rescan; i++) {
+        names[i][CHANGE_SLOT - 1] = '\0';
+        if (!names[i][0]) rescan = true;
+        else catalog_sync(storage_dir, names[i]);
+    }
+    if (rescan) fanout_walk(storage_dir, 2, changes_rescan_one, (void *)storage_dir);
+    changes.seen = seq;
+    pthread_mutex_unlock(&changes.mu);
+    free(names);
+}
+
+// Startup: move the objects of the flat layout (one file per object directly
+// in storage_dir) into their fan-out directories. They pass through
+// META_DIR/flat, so a file named like a fan-out directory steps aside first
+// and the next start finishes a migration a crash cut short.
+static void objects_migrate(const char *storage_dir) {
+    char stage[MAX_PATH];
+    snprintf(stage, sizeof(stage), "%s/" META_DIR "/flat", storage_dir);
+    if (mkdir(stage, 0755) < 0 && errno != EEXIST) die("Failed to create %s", stage);
+    DIR *d = opendir(storage_dir);
+    if (!d) die("Failed to open storage dir: %s", storage_dir);
+    struct dirent *de;
+    while ((de = readdir(d)) != NULL) {
+        char from[MAX_PATH], to[MAX_PATH];
+        struct stat st;
+        if (!object_path(to, sizeof(to), storage_dir, de->d_name) ||
+            snprintf(from, sizeof(from), "%s/%s", storage_dir, de->d_name) >= (int)sizeof(from) ||
+            snprintf(to, sizeof(to), "%s/%s", stage, de->d_name) >= (int)sizeof(to)) continue;
+        if (stat(from, &st) < 0 || !S_ISREG(st.st_mode)) continue;
+        if (rename(from, to) < 0 && errno != ENOENT) die("Failed to move %s", from);
+    }
+    closedir(d);
+    d = opendir(stage);
+    if (!d) die("Failed to open %s", stage);
+    while ((de = readdir(d)) != NULL) {
+        char from[MAX_PATH], to[MAX_PATH];
+        if (!strcmp(de->d_name, ".") || !strcmp(de->d_name, "..") ||
+            snprintf(from, sizeof(from), "%s/%s", stage, de->d_name) >= (int)sizeof(from) ||
+            !object_path(to, sizeof(to), storage_dir, de->d_name)) continue;
+        if ((!fanout_dirs(to) || rename(from, to) < 0) && errno != ENOENT) die("Failed to move %s", from);
+    }
+    closedir(d);
+}
+
+// Index one object file found at startup. The index is ordered by name, so
+// LIST doesn't depend on the layout or readdir order.
+static void catalog_load_one(const char *name, void *arg) {
+    char path[MAX_PATH];
+    long long size, crc;
+    time_t mtime;
+    // A file in the wrong fan-out directory isn't found.
+    if (object_path(path, sizeof(path), (const char *)arg, name) && object_stat(path, true, &size, &mtime, &crc))
+        catalog_put_locked(name, size, mtime, crc, -1, 0);
+}
+
+static void catalog_load(const char *storage_dir) {
+    catalog_grow();
+    catalog.head = entry_new("", SKIP_MAX_LEVEL);
+    if (!catalog.head) die("out of memory");
+    objects_migrate(storage_dir);
+    fanout_walk(storage_dir, 2, catalog_load_one, (void *)storage_dir);
+    versions_load(storage_dir);
+    chunks_sweep();
+}
+
+// Durability of UPLOADs (--fsync):
+//   always  fsync() each upload before replying (default)
+//   group   hand the file to the committer thread, which waits --fsync-window-us
+//           for more uploads, then flushes the whole batch at once (one syncfs()
+//           for large batches, else one fdatasync() each) and releases them all
+//   none    rely on the page cache; a crash may lose recently acknowledged data
+enum { FSYNC_ALWAYS, FSYNC_GROUP, FSYNC_NONE };
+#define SYNCFS_BATCH 32
+
+static int fsync_mode = FSYNC_ALWAYS;
+static bool splice_ok = true;   // cleared if the kernel refuses socket splice()
+static long fsync_window_us = 2000;
+
+typedef struct {
+    pthread_mutex_t mu;
+    pthread_cond_t work, done;
+    int *fds;                   // dup()ed descriptors of the open batch
+    size_t n, cap;
+    bool whole_fs;              // the batch wrote files it has no fd for: syncfs()
+    uint64_t batch;             // number of the batch accepting uploads
+    uint64_t synced;            // every batch <= synced is durable
+    int *wake_fds;              // epoll loops' eventfds, poked after each batch
+    int nwake;
+} group_commit_t;
+
+static group_commit_t gcommit = {
+    PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER, PTHREAD_COND_INITIALIZER,
+    NULL, 0, 0, false, 1, 0, NULL, 0
+};
+
+// Queue fd for the next group flush; returns the ticket to wait for. Falls back
+// to an inline fsync (ticket 0, already satisfied) if the fd can't be queued.
+// whole_fs: other new files (dedup chunks) must be flushed too.
+static uint64_t group_commit_submit(int fd, bool whole_fs) {
+    int dfd = dup(fd);
+    pthread_mutex_lock(&gcommit.mu);
+    if (dfd >= 0 && gcommit.n == gcommit.cap) {
+        size_t cap = gcommit.cap ? gcommit.cap * 2 : 64;
+        int *p = (int *)realloc(gcommit.fds, cap * sizeof(int));
+        if (p) { gcommit.fds = p; gcommit.cap = cap; }
+    }
+    if (dfd < 0 || gcommit.n == gcommit.cap) {
+        pthread_mutex_unlock(&gcommit.mu);
+        if (dfd >= 0) close(dfd);
+        if (whole_fs) syncfs(fd);
+        else fsync(fd);
+        return 0;
+    }
+    gcommit.fds[gcommit.n++] = dfd;
+    if (whole_fs) gcommit.whole_fs = true;
+    uint64_t ticket = gcommit.batch;
+    pthread_cond_signal(&gcommit.work);
+    pthread_mutex_unlock(&gcommit.mu);
+    return ticket;
+}
+
+static bool group_commit_done(uint64_t ticket) {
+    return __atomic_load_n(&gcommit.synced, __ATOMIC_ACQUIRE) >= ticket;
+}
+
+static void group_commit_wait(uint64_t ticket) {
+    pthread_mutex_lock(&gcommit.mu);
+    while (gcommit.synced < ticket) pthread_cond_wait(&gcommit.done, &gcommit.mu);
+    pthread_mutex_unlock(&gcommit.mu);
+}
+
+static void *group_commit_thread(void *arg) {
+    (void)arg;
+    for (;;) {
+        pthread_mutex_lock(&gcommit.mu);
+        while (gcommit.n == 0) pthread_cond_wait(&gcommit.work, &gcommit.mu);
+        pthread_mutex_unlock(&gcommit.mu);
+
+        usleep((useconds_t)fsync_window_us); // let concurrent uploads join the batch
+
+        pthread_mutex_lock(&gcommit.mu);
+        int *fds = gcommit.fds;
+        size_t n = gcommit.n;
+        bool whole_fs = gcommit.whole_fs;
+        uint64_t id = gcommit.batch++;
+        gcommit.fds = NULL;
+        gcommit.n = gcommit.cap = 0;
+        gcommit.whole_fs = false;
+        pthread_mutex_unlock(&gcommit.mu);
+
+        if (n >= SYNCFS_BATCH || whole_fs) {
+            syncfs(fds[0]);
+        } else {
+            for (size_t i = 0; i < n; i++) fdatasync(fds[i]);
+        }
+        for (size_t i = 0; i < n; i++) close(fds[i]);
+        free(fds);
+
+        pthread_mutex_lock(&gcommit.mu);
+        __atomic_store_n(&gcommit.synced, id, __ATOMIC_RELEASE);
+        pthread_cond_broadcast(&gcommit.done);
+        pthread_mutex_unlock(&gcommit.mu);
+        uint64_t one = 1;
+        for (int i = 0; i < gcommit.nwake; i++) {
+            if (write(gcommit.wake_fds[i], &one, sizeof(one)) < 0) { /* already signalled */ }
+        }
+    }
+    return NULL;
+}
+
+// rename(from, to), or unlink(to) when from is NULL, then drop the chunk
+// references of the manifest that was at `to` unless it was kept as a version
+// of `name`. The caller write-holds the name lock of `to` (and of `from` when
+// it is an object), so each replaced manifest's references are dropped
+// exactly once.
+static int object_replace(const char *from, const char *to, const char *name) {
+    struct stat a, b;
+    manifest_t *old = __atomic_load_n(&chunks.count, __ATOMIC_RELAXED) ? manifest_load(to) : NULL;
+    if ((old || versions.enabled) && from && stat(from, &a) == 0 && stat(to, &b) == 0 &&
+        a.st_ino == b.st_ino && a.st_dev == b.st_dev) {
+        manifest_free(old); // renamed onto itself: nothing is replaced
+        return rename(from, to);
+    }
+    char kept[MAX_PATH];
+    bool versioned = version_keep(to, name, kept, sizeof(kept));
+    int r = from ? rename(from, to) : unlink(to);
+    if (r < 0 && from && errno == ENOENT && fanout_dirs(to)) r = rename(from, to); // first of its shard
+    int err = errno;
+    if (r < 0 && versioned) unlink(kept);
+    if (r == 0 && versioned) version_queue(name);
+    else if (r == 0 && old) chunk_release(old);
+    manifest_free(old);
+    errno = err;
+    return r;
+}
+
+// Small objects (--small-max): an upload of at most that many bytes becomes a
+// needle appended to a volume file under META_DIR/volumes instead of a file of
+// its own, and its catalog entry records where, so a DOWNLOAD is one sendfile()
+// at that offset with no open()/fstat() of a per-object file. A needle is
+//   "MCSN", flags, name length (16 bits), CRC32C of the data, CRC32C of the
+//   header and name, size, mtime (64 bits, all big-endian), name, data
+// padded to NEEDLE_ALIGN. When volumes are replayed at startup the later needle
+// of a name wins, a tombstone (NEEDLE_DEAD) ends one and a plain file of the
+// same name wins over both. Replaced needles leave dead bytes; the compactor
+// copies the live needles of a mostly dead volume to the active one and
+// deletes it. Because log order is publish order, it leaves a needle where it
+// is while an upload of a name of the same lock shard is still unpublished.
+#define NEEDLE_MAGIC "MCSN"
+#define NEEDLE_HDR 32
+#define NEEDLE_ALIGN 8
+#define NEEDLE_DEAD 1
+#define VOLUME_MAX (1LL << 30)  // a volume takes no more needles past this
+#define MAX_VOLUMES 1024
+#define COMPACT_INTERVAL 10     // seconds between compactor passes
+
+typedef struct {
+    int fd;
+    uint64_t seq;               // names the file and orders volumes; 0: free slot
+    long long end;              // append offset
+    long long dead;             // bytes no live needle uses
+    int pending;                // needles appended but not yet published
+} volume_t;
+
+typedef struct {
+    pthread_mutex_t mu;         // the table and append offsets
+    pthread_cond_t wake;        // the compactor
+    volume_t v[MAX_VOLUMES];
+    int active;                 // slot taking appends, -1 if none yet
+    uint64_t next_seq;
+    bool used;                  // some volume exists: DOWNLOAD looks for needles
+    int pending_names[NAME_LOCK_SHARDS]; // unpublished needles by name lock shard
+    long long small_max;        // --small-max, 0: off
+    char dir[MAX_PATH];
+} volume_store_t;
+
+static volume_store_t volumes = { PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER, {{0, 0, 0, 0, 0}},
+                                  -1, 1, false, {0}, 0, "" };
+
+static int *needle_pending_locked(const char *name) {
+    return &volumes.pending_names[name_hash(name) % NAME_LOCK_SHARDS];
+}
+
+typedef struct {
+    int vol;                    // slot, -1 if none
+    long long off;              // of the data in the volume
+    long long size;
+    uint32_t crc;
+    time_t mtime;
+} needle_t;
+
+// One needle read back from a volume.
+typedef struct {
+    uint8_t flags;
+    char name[MAX_PATH];
+    needle_t n;
+    const uint8_t *data;
+    long long len;              // whole record, padding included
+} needle_rec_t;
+
+static void be_put(uint8_t *p, uint64_t v, int n) {
+    for (int i = n - 1; i >= 0; i--, v >>= 8) p[i] = (uint8_t)v;
+}
+
+static uint64_t be_get(const uint8_t *p, int n) {
+    uint64_t v = 0;
+    for (int i = 0; i < n; i++) v = (v << 8) | p[i];
+    return v;
+}
+
+static long long needle_len(size_t name_len, long long size) {
+    long long n = NEEDLE_HDR + (long long)name_len + size;
+    return (n + NEEDLE_ALIGN - 1) / NEEDLE_ALIGN * NEEDLE_ALIGN;
+}
+
+static void needle_header(uint8_t *h, const char *name, uint8_t flags, const needle_t *n) {
+    size_t len = strlen(name);
+    memcpy(h, NEEDLE_MAGIC, 4);
+    h[4] = flags;
+    h[5] = 0;
+    be_put(h + 6, len, 2);
+    be_put(h + 8, n->crc, 4);
+    be_put(h + 12, 0, 4);
+    be_put(h + 16, (uint64_t)n->size, 8);
+    be_put(h + 24, (uint64_t)n->mtime, 8);
+    be_put(h + 12, crc32c(crc32c(0, h, NEEDLE_HDR), name, len), 4);
+}
+
+// Parse the record at p (avail bytes); its length, or 0 if it isn't a valid one.
+static long long needle_parse(const uint8_t *p, long long avail, needle_rec_t *r) {
+    if (avail < NEEDLE_HDR || memcmp(p, NEEDLE_MAGIC, 4) != 0) return 0;
+    size_t len = (size_t)be_get(p + 6, 2);
+    long long size = (long long)be_get(p + 16, 8);
+    if (len == 0 || len >= MAX_PATH || size < 0 || size > IO_BUF || needle_len(len, size) > avail) return 0;
+    uint8_t h[NEEDLE_HDR];
+    memcpy(h, p, NEEDLE_HDR);
+    be_put(h + 12, 0, 4);
+    if (crc32c(crc32c(0, h, NEEDLE_HDR), p + NEEDLE_HDR, len) != (uint32_t)be_get(p + 12, 4)) return 0;
+    r->flags = p[4];
+    memcpy(r->name, p + NEEDLE_HDR, len);
+    r->name[len] = '\0';
+    r->n.size = size;
+    r->n.crc = (uint32_t)be_get(p + 8, 4);
+    r->n.mtime = (time_t)be_get(p + 24, 8);
+    r->data = p + NEEDLE_HDR + len;
+    if (crc32c(0, r->data, (size_t)size) != r->n.crc) return 0; // torn write
+    r->len = needle_len(len, size);
+    return r->len;
+}
+
+// Call fn for each valid record of volume v, in order, skipping damage;
+// returns the end of the last one.
+static long long volume_scan(int v, void (*fn)(int v, needle_rec_t *r, void *arg), void *arg) {
+    const size_t cap = 1 << 20;
+    uint8_t *buf = (uint8_t *)malloc(cap);
+    needle_rec_t *r = (needle_rec_t *)malloc(sizeof(*r));
+    long long pos = 0, start = 0, end = 0;
+    ssize_t got = 0;
+    bool eof = false;
+    while (buf && r) {
+        // Refill unless the largest possible record at pos is buffered.
+        if (start + got - pos < needle_len(MAX_PATH, IO_BUF) && !eof) {
+            start = pos;
+            got = pread(volumes.v[v].fd, buf, cap, (off_t)pos);
+            if (got < 0) break;
+            eof = (size_t)got < cap;
+        }
+        if (pos >= start + got) break;
+        long long len = needle_parse(buf + (pos - start), start + got - pos, r);
+        if (!len) {
+            pos += NEEDLE_ALIGN;
+            continue;
+        }
+        r->n.vol = v;
+        r->n.off = pos + NEEDLE_HDR + (long long)strlen(r->name);
+        fn(v, r, arg);
+        pos += len;
+        end = pos;
+    }
+    free(buf);
+    free(r);
+    return end;
+}
+
+static bool volume_path(char *out, size_t cap, uint64_t seq) {
+    int r = snprintf(out, cap, "%s/%016llx.vol", volumes.dir, (unsigned long long)seq);
+    return r > 0 && (size_t)r < cap;
+}
+
+// Caller holds volumes.mu.
+static int volume_create_locked(void) {
+    int v = 0;
+    while (v < MAX_VOLUMES && volumes.v[v].seq) v++;
+    char path[MAX_PATH];
+    uint64_t seq = volumes.next_seq;
+    if (v == MAX_VOLUMES || !volume_path(path, sizeof(path), seq)) return -1;
+    int fd = open(path, O_RDWR | O_CREAT | O_EXCL | O_CLOEXEC, 0644);
+    if (fd < 0) return -1;
+    volumes.next_seq++;
+    volumes.v[v] = (volume_t){ fd, seq, 0, 0, 0 };
+    volumes.used = true;
+    return v;
+}
+
+// Append a needle (pending until needle_done()); fills in n->vol and n->off.
+static bool volume_append(const char *name, uint8_t flags, const void *data, needle_t *n) {
+    size_t nl = strlen(name);
+    long long len = needle_len(nl, n->size);
+    pthread_mutex_lock(&volumes.mu);
+    int v = volumes.active;
+    if (v < 0 || volumes.v[v].end + len > VOLUME_MAX) v = volumes.active = volume_create_locked();
+    if (v < 0) {
+        pthread_mutex_unlock(&volumes.mu);
+        return false;
+    }
+    long long at = volumes.v[v].end;
+    volumes.v[v].end += len;
+    volumes.v[v].pending++;
+    (*needle_pending_locked(name))++;
+    int fd = volumes.v[v].fd;
+    pthread_mutex_unlock(&volumes.mu);
+
+    static const uint8_t pad[NEEDLE_ALIGN];
+    uint8_t h[NEEDLE_HDR];
+    needle_header(h, name, flags, n);
+    struct iovec iov[4] = {
+        { h, NEEDLE_HDR }, { (void *)name, nl }, { (void *)data, (size_t)n->size },
+        { (void *)pad, (size_t)(len - NEEDLE_HDR - (long long)nl - n->size) }
+    };
+    n->vol = v;
+    n->off = at + NEEDLE_HDR + (long long)nl;
+    if (pwritev(fd, iov, 4, (off_t)at) == (ssize_t)len) return true;
+    pthread_mutex_lock(&volumes.mu);
+    volumes.v[v].dead += len;
+    volumes.v[v].pending--;
+    (*needle_pending_locked(name))--;
+    pthread_mutex_unlock(&volumes.mu);
+    return false;
+}
+
+// An appended needle is published (live) or not needed after all.
+static void needle_done(const char *name, const needle_t *n, bool live) {
+    pthread_mutex_lock(&volumes.mu);
+    volumes.v[n->vol].pending--;
+    (*needle_pending_locked(name))--;
+    if (!live) volumes.v[n->vol].dead += needle_len(strlen(name), n->size);
+    pthread_mutex_unlock(&volumes.mu);
+}
+
+static void volume_sync(int v) {
+    if (fsync_mode != FSYNC_NONE) fdatasync(volumes.v[v].fd);
+}
+
+// Is a stored later than b?
+static bool needle_after(const needle_t *a, const needle_t *b) {
+    uint64_t sa = volumes.v[a->vol].seq, sb = volumes.v[b->vol].seq;
+    return sa != sb ? sa > sb : a->off > b->off;
+}
+
+// Catalog entry of name as a needle; false if it is a file or absent.
+static bool needle_get(const char *name, needle_t *n) {
+    pthread_rwlock_rdlock(&catalog.lock);
+    meta_entry_t *e = catalog_find(name);
+    bool found = e && e->vol >= 0;
+    if (found) *n = (needle_t){ e->vol, e->voff, e->size, (uint32_t)e->crc, e->mtime };
+    pthread_rwlock_unlock(&catalog.lock);
+    return found;
+}
+
+// For readers: a descriptor of the volume holding name's needle, or -1. The
+// dup() is taken under the catalog lock, which the compactor holds to close a
+// volume, so the needle stays readable through it.
+static int needle_open(const char *name, needle_t *n) {
+    if (!__atomic_load_n(&volumes.used, __ATOMIC_RELAXED)) return -1;
+    int fd = -1;
+    pthread_rwlock_rdlock(&catalog.lock);
+    meta_entry_t *e = catalog_find(name);
+    if (e && e->vol >= 0) {
+        *n = (needle_t){ e->vol, e->voff, e->size, (uint32_t)e->crc, e->mtime };
+        fd = dup(volumes.v[e->vol].fd);
+    }
+    pthread_rwlock_unlock(&catalog.lock);
+    return fd;
+}
+
+// Copy a needle into a version file (see version_keep()), made durable per
+// --fsync like the needle it replaces. A failure is logged; the replacement
+// still goes ahead.
+static void needle_keep_version(const char *name, const needle_t *n) {
+    char path[MAX_PATH];
+    unsigned long long id = now_us();
+    int fd = -1;
+    bool made_dir = false;
+    while (version_path(path, sizeof(path), name, id)) {
+        fd = open(path, O_WRONLY | O_CREAT | O_EXCL, 0644);
+        if (fd >= 0) break;
+        if (errno == EEXIST) {
+            id++;
+            continue;
+        }
+        if (errno != ENOENT || made_dir || !version_mkdir(name)) break;
+        made_dir = true;
+    }
+    bool ok = fd >= 0;
+    if (ok) {
+        char buf[IO_BUF]; // needles are at most --small-max <= IO_BUF bytes
+        errno = EIO;      // for a short read or write
+        ok = pread(volumes.v[n->vol].fd, buf, (size_t)n->size, (off_t)n->off) == n->size &&
+             write(fd, buf, (size_t)n->size) == n->size;
+        if (ok) crc_xattr_set(fd, n->crc);
+        if (ok && fsync_mode != FSYNC_NONE && fdatasync(fd) < 0) ok = false;
+        int err = errno;
+        close(fd);
+        if (!ok) unlink(path);
+        errno = err;
+    }
+    if (ok) version_queue(name);
+    else fprintf(stderr, "version of %s not kept: %s\n", name, strerror(errno));
+}
+
+// name's needle, if it has one, stops being live (the caller write-holds the
+// name lock and then replaces or removes the catalog entry). A tombstone is
+// needed unless a later needle of the name takes over.
+static void needle_retire(const char *name, bool tombstone, bool keep_version) {
+    needle_t old;
+    if (!needle_get(name, &old)) return;
+    if (keep_version && versions.enabled) needle_keep_version(name, &old);
+    needle_t t = { -1, 0, 0, 0, time(NULL) };
+    if (tombstone && volume_append(name, NEEDLE_DEAD, NULL, &t)) {
+        volume_sync(t.vol);
+        needle_done(name, &t, false);
+    }
+    pthread_mutex_lock(&volumes.mu);
+    volumes.v[old.vol].dead += needle_len(strlen(name), old.size);
+    pthread_mutex_unlock(&volumes.mu);
+    pthread_cond_signal(&volumes.wake);
+}
+
+// Make an appended (and durable) needle the object `name` at `path`, unless a
+// later needle of the name was published meanwhile. Caller write-holds the
+// name lock.
+static void needle_publish(const char *name, const char *path, const needle_t *n) {
+    needle_t cur;
+    if (needle_get(name, &cur) && needle_after(&cur, n)) {
+        needle_done(name, n, false);
+        return;
+    }
+    pthread_rwlock_rdlock(&catalog.lock);
+    meta_entry_t *e = catalog_find(name);
+    bool file = e && e->vol < 0;
+    pthread_rwlock_unlock(&catalog.lock);
+    if (file) object_replace(NULL, path, name);
+    needle_retire(name, false, true);
+    pthread_rwlock_wrlock(&catalog.lock);
+    catalog_put_locked(name, n->size, n->mtime, n->crc, n->vol, n->off);
+    pthread_rwlock_unlock(&catalog.lock);
+    needle_done(name, n, true);
+}
+
+// RENAME of a needle. The name is part of the record, so the data is appended
+// again under newn before oldn gets its tombstone. Caller write-holds both
+// names' locks.
+static int needle_rename(const char *oldn, const char *newn, const char *newp) {
+    needle_t n;
+    if (!needle_get(oldn, &n)) {
+        errno = ENOENT;
+        return -1;
+    }
+    if (strcmp(oldn, newn) == 0) return 0;
+    char *data = (char *)malloc((size_t)n.size + 1);
+    bool ok = data && pread(volumes.v[n.vol].fd, data, (size_t)n.size, (off_t)n.off) == n.size &&
+              volume_append(newn, 0, data, &n);
+    free(data);
+    if (!ok) {
+        errno = EIO;
+        return -1;
+    }
+    volume_sync(n.vol);
+    needle_publish(newn, newp, &n);
+    needle_retire(oldn, true, false);
+    catalog_remove(oldn);
+    return 0;
+}
+
+static void needle_commit(const char *storage_dir, const char *name, const needle_t *n) {
+    char path[MAX_PATH];
+    name_lock_t nl;
+    object_path(path, sizeof(path), storage_dir, name); // checked by UPLOAD
+    name_lock(&nl, name, NULL, true);
+    needle_publish(name, path, n);
+    name_unlock(&nl);
+}
+
+static void volume_replay_one(int v, needle_rec_t *r, void *arg) {
+    (void)v;
+    (void)arg;
+    meta_entry_t *e = catalog_find(r->name);
+    if (e && e->vol < 0) {
+        // A file wins. A needle it hides was left by a crash before a needle
+        // upload removed the file, or before the tombstone that follows a
+        // file replacing a needle: that tombstone is written once all
+        // volumes are read.
+        e->voff = !(r->flags & NEEDLE_DEAD);
+        return;
+    }
+    if (r->flags & NEEDLE_DEAD) free(catalog_unlink_locked(r->name));
+    else catalog_put_locked(r->name, r->n.size, r->n.mtime, r->n.crc, r->n.vol, r->n.off);
+}
+
+static int seq_cmp(const void *a, const void *b) {
+    uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+    return (x > y) - (x < y);
+}
+
+// Startup, after catalog_load(): replay the volumes in order into the catalog.
+static void volumes_load(const char *storage_dir) {
+    snprintf(volumes.dir, sizeof(volumes.dir), "%s/" META_DIR "/volumes", storage_dir);
+    if (mkdir(volumes.dir, 0755) < 0 && errno != EEXIST) die("Failed to create %s", volumes.dir);
+    DIR *d = opendir(volumes.dir);
+    if (!d) die("Failed to open %s", volumes.dir);
+    uint64_t seqs[MAX_VOLUMES];
+    int n = 0;
+    struct dirent *de;
+    while ((de = readdir(d)) != NULL) {
+        unsigned long long seq;
+        char tail[8];
+        if (sscanf(de->d_name, "%16llx.%7s", &seq, tail) != 2 || strcmp(tail, "vol") != 0 || seq == 0) continue;
+        if (n == MAX_VOLUMES) die("Too many volumes in %s", volumes.dir);
+        seqs[n++] = seq;
+    }
+    closedir(d);
+    qsort(seqs, (size_t)n, sizeof(seqs[0]), seq_cmp);
+    for (int v = 0; v < n; v++) {
+        char path[MAX_PATH];
+        int fd = volume_path(path, sizeof(path), seqs[v]) ? open(path, O_RDWR | O_CLOEXEC) : -1;
+        if (fd < 0) die("Failed to open %s", path);
+        volumes.v[v] = (volume_t){ fd, seqs[v], 0, 0, 0 };
+        volumes.v[v].end = volume_scan(v, volume_replay_one, NULL);
+        volumes.v[v].dead = volumes.v[v].end;
+        volumes.next_seq = seqs[v] + 1;
+        volumes.active = v;
+        volumes.used = true;
+    }
+    // Dead bytes: whatever live needles don't cover. Shadowed needles get
+    // their tombstone now.
+    for (meta_entry_t *e = catalog.head->fwd[0]; e; e = e->fwd[0]) {
+        if (e->vol >= 0) {
+            volumes.v[e->vol].dead -= needle_len(strlen(e->name), e->size);
+        } else if (e->voff) {
+            needle_t t = { -1, 0, 0, 0, time(NULL) };
+            if (volume_append(e->name, NEEDLE_DEAD, NULL, &t)) needle_done(e->name, &t, false);
+            e->voff = 0;
+        }
+    }
+    if (volumes.active >= 0) volume_sync(volumes.active);
+}
+
+typedef struct {
+    bool older;                 // volumes older than the one compacted exist
+    int copied;
+    long long moved;            // bytes of the live needles copied
+    bool skipped;               // a record had to stay: keep the volume
+} compact_t;
+
+// Copy one record of the volume being compacted if it still matters: a live
+// needle, or a tombstone that may still hide a needle in an older volume.
+static void volume_compact_one(int v, needle_rec_t *r, void *arg) {
+    compact_t *cp = (compact_t *)arg;
+    name_lock_t nl;
+    name_lock(&nl, r->name, NULL, true);
+    pthread_rwlock_rdlock(&catalog.lock);
+    meta_entry_t *e = catalog_find(r->name);
+    bool live = !(r->flags & NEEDLE_DEAD) && e && e->vol == v && e->voff == r->n.off;
+    bool keep_dead = (r->flags & NEEDLE_DEAD) && cp->older && !(e && e->vol >= 0);
+    pthread_rwlock_unlock(&catalog.lock);
+    if (live || keep_dead) {
+        // A copy would land after an unpublished needle of the name.
+        pthread_mutex_lock(&volumes.mu);
+        bool busy = *needle_pending_locked(r->name) != 0;
+        pthread_mutex_unlock(&volumes.mu);
+        if (busy) {
+            cp->skipped = true;
+            name_unlock(&nl);
+            return;
+        }
+    }
+    needle_t n = r->n;
+    if ((live || keep_dead) && volume_append(r->name, r->flags, r->data, &n)) {
+        if (live) {
+            pthread_rwlock_wrlock(&catalog.lock);
+            e = catalog_find(r->name);
+            if (e) {
+                e->vol = n.vol;
+                e->voff = n.off;
+            }
+            pthread_rwlock_unlock(&catalog.lock);
+        }
+        needle_done(r->name, &n, live);
+        cp->copied++;
+        if (live) cp->moved += r->len;
+    }
+    name_unlock(&nl);
+}
+
+// Copy what is still needed out of volume v, then delete it (or, if a record
+// had to stay, count the copied ones dead and retry later). Readers that
+// already hold a descriptor of it keep reading the unlinked file.
+static void volume_compact(int v) {
+    compact_t cp = { false, 0, 0, false };
+    pthread_mutex_lock(&volumes.mu);
+    for (int i = 0; i < MAX_VOLUMES; i++) {
+        if (volumes.v[i].seq && volumes.v[i].seq < volumes.v[v].seq) cp.older = true;
+    }
+    pthread_mutex_unlock(&volumes.mu);
+    volume_scan(v, volume_compact_one, &cp);
+    if (cp.copied && volumes.active >= 0) volume_sync(volumes.active);
+    if (cp.skipped) {
+        pthread_mutex_lock(&volumes.mu);
+        volumes.v[v].dead += cp.moved;
+        pthread_mutex_unlock(&volumes.mu);
+        return;
+    }
+    char path[MAX_PATH];
+    bool named = volume_path(path, sizeof(path), volumes.v[v].seq);
+    pthread_rwlock_wrlock(&catalog.lock);
+    pthread_mutex_lock(&volumes.mu);
+    if (named) unlink(path);
+    close(volumes.v[v].fd);
+    volumes.v[v] = (volume_t){ -1, 0, 0, 0, 0 };
+    pthread_mutex_unlock(&volumes.mu);
+    pthread_rwlock_unlock(&catalog.lock);
+}
+
+// Compacts, one at a time, volumes that are at least half dead. The active
+// volume and volumes with unpublished needles wait.
+static void *compact_thread(void *arg) {
+    (void)arg;
+    for (;;) {
+        pthread_mutex_lock(&volumes.mu);
+        struct timespec ts;
+        clock_gettime(CLOCK_REALTIME, &ts);
+        ts.tv_sec += COMPACT_INTERVAL;
+        pthread_cond_timedwait(&volumes.wake, &volumes.mu, &ts);
+        int best = -1;
+        for (int i = 0; i < MAX_VOLUMES; i++) {
+            volume_t *vl = &volumes.v[i];
+            if (!vl->seq || i == volumes.active || vl->pending || vl->end == 0 || vl->dead * 2 < vl->end) continue;
+            if (best < 0 || vl->dead > volumes.v[best].dead) best = i;
+        }
+        pthread_mutex_unlock(&volumes.mu);
+        if (best >= 0) volume_compact(best);
+    }
+    return NULL;
+}
+
+// Per-connection state shared by both engines. Handlers never touch the socket
+// directly: they queue replies in `out` and, for UPLOAD/DOWNLOAD, switch the
+// connection into a body state that upload_pump()/download_pump() advance.
+typedef enum {
+    CONN_CMD,       // waiting for a command line
+    CONN_UPLOAD,    // receiving an UPLOAD body into file_fd
+    CONN_SYNC,      // UPLOAD body written, waiting for its group commit
+    CONN_DOWNLOAD,  // streaming file_fd to the client
+    CONN_CLOSING,   // flush queued replies, then close
+} conn_state_t;
+
+struct event_loop;
+
+typedef struct conn {
+    int fd;
+    conn_state_t state;
+    const char *storage_dir;
+    struct event_loop *loop;    // owning epoll loop, NULL on a blocking socket
+    char *scratch;              // IO_BUF bytes owned by the serving thread/loop
+    uring_t *ring;              // per-thread io_uring (--engine=uring), else NULL
+    rbuf_t in;                  // received bytes not yet consumed
+    char *out;                  // queued replies not yet sent
+    size_t out_len, out_off, out_cap;
+    int file_fd;                // file being transferred, -1 if none
+    long long remaining;        // UPLOAD body bytes still expected
+    off_t file_off, file_size;  // bytes written (UPLOAD) / next offset and end (DOWNLOAD)
+    char name[MAX_PATH];        // object being uploaded
+    char tmp[MAX_PATH];         // named temp file of the upload, "" for O_TMPFILE
+    bool session_part;          // the body is an UPLOAD_PART: keep it on failure
+    int pipe_rd, pipe_wr;       // splice() pipe of a large upload, -1 if none
+    size_t piped;               // body bytes sitting in that pipe
+    uint32_t crc;               // CRC32C of the UPLOAD body so far
+    bool crc_inline;            // ... valid: every byte went through user space
+    long long want_crc;         // checksum the client expects, -1 for none
+    bool zwire;                 // this body travels as LZ4 frames
+    uint8_t *zbuf;              // ZFRAME_MAX bytes: frame being received / packed
+    size_t zlen;                // bytes of it received so far
+    chunker_t *ck;              // --dedup: chunks of the upload so far
+    packer_t *pk;               // --compress: the upload being packed
+    needle_t needle;            // --small-max: the upload appended to a volume
+    manifest_t *man;            // DOWNLOAD of a chunked object, else NULL
+    packed_t *packed;           // DOWNLOAD of a packed object (file_fd), else NULL
+    int chunk_fd;               // chunk being sent, -1 if none
+    size_t chunk_idx;           // its index in man
+    uint64_t sync_ticket;       // group commit batch the upload waits for
+    bool parked;                // on loop->parked until that batch is durable
+    struct conn *park_next;
+} conn_t;
+
+// Result of a non-blocking step. With blocking sockets IO_AGAIN never happens.
+enum { IO_ERR = -1, IO_AGAIN = 0, IO_DONE = 1 };
+
+static void conn_init(conn_t *c, int fd, const char *storage_dir, char *scratch) {
+    memset(c, 0, sizeof(*c));
+    c->fd = fd;
+    c->state = CONN_CMD;
+    c->storage_dir = storage_dir;
+    c->scratch = scratch;
+    c->file_fd = -1;
+    c->pipe_rd = c->pipe_wr = -1;
+    c->chunk_fd = -1;
+    c->needle.vol = -1;
+}
+
+static void conn_release_file(conn_t *c) {
+    if (c->file_fd >= 0) {
+        close(c->file_fd);
+        c->file_fd = -1;
+    }
+    if (c->pipe_rd >= 0) {
+        close(c->pipe_rd);
+        close(c->pipe_wr);
+        c->pipe_rd = c->pipe_wr = -1;
+        c->piped = 0;
+    }
+    if (c->man) {
+        if (c->chunk_fd >= 0) close(c->chunk_fd);
+        c->chunk_fd = -1;
+        chunk_release(c->man);
+        manifest_free(c->man);
+        c->man = NULL;
+    }
+    packed_free(c->packed);
+    c->packed = NULL;
+}
+
+// Switch the next body to LZ4 frames ("lz4" on the command) or raw bytes.
+static bool conn_set_zwire(conn_t *c, bool on) {
+    c->zwire = on;
+    c->zlen = 0;
+    if (on && !c->zbuf) c->zbuf = (uint8_t *)malloc(ZFRAME_MAX);
+    return !on || c->zbuf;
+}
+
+// Throw away an unfinished upload: the live object was never touched.
+static void upload_discard(conn_t *c) {
+    conn_release_file(c);
+    chunker_free(c->ck, true);
+    c->ck = NULL;
+    packer_free(c->pk);
+    c->pk = NULL;
+    if (c->session_part) {
+        c->session_part = false; // the bytes received so far stay in the session
+        return;
+    }
+    if (c->tmp[0]) {
+        unlink(c->tmp);
+        c->tmp[0] = '\0';
+    }
+}
+
+static void conn_destroy(conn_t *c) {
+    if (c->state == CONN_SYNC && c->needle.vol >= 0) {
+        // Already in a volume, so a needle is kept like an upload whose
+        // "OK SAVED" got lost: replay would bring it back anyway.
+        needle_commit(c->storage_dir, c->name, &c->needle);
+        c->needle.vol = -1;
+    }
+    if (c->state == CONN_UPLOAD || c->state == CONN_SYNC) upload_discard(c);
+    conn_release_file(c);
+    free(c->zbuf);
+    free(c->out);
+    close(c->fd);
+}
+
+static int conn_write(conn_t *c, const void *data, size_t len) {
+    if (c->out_len + len > c->out_cap) {
+        size_t cap = c->out_cap ? c->out_cap : MAX_LINE;
+        while (cap < c->out_len + len) cap *= 2;
+        char *p = (char *)realloc(c->out, cap);
+        if (!p) return -1;
+        c->out = p;
+        c->out_cap = cap;
+    }
+    memcpy(c->out + c->out_len, data, len);
+    c->out_len += len;
+    return 0;
+}
+
+static int conn_reply(conn_t *c, const char *fmt, ...) {
+    char buf[MAX_LINE];
+    va_list ap; va_start(ap, fmt);
+    int n = vsnprintf(buf, sizeof(buf), fmt, ap);
+    va_end(ap);
+    if (n < 0) return -1;
+    if ((size_t)n >= sizeof(buf)) n = (int)sizeof(buf) - 1;
+    return conn_write(c, buf, (size_t)n);
+}
+
+// Send queued replies. IO_DONE once all are out, IO_AGAIN if the socket is full.
+static int conn_flush(conn_t *c) {
+    while (c->out_off < c->out_len) {
+        ssize_t n = send(c->fd, c->out + c->out_off, c->out_len - c->out_off, MSG_NOSIGNAL);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK) return IO_AGAIN;
+            return IO_ERR;
+        }
+        c->out_off += (size_t)n;
+    }
+    c->out_off = c->out_len = 0;
+    return IO_DONE;
+}
+
+// --shared-dir: before a LIST page, pick up the names other servers added,
+// then refresh the entries the page will show (and the one after it, which
+// decides NEXT) from their files, dropping those another server removed.
+#define SYNC_BATCH 64
+
+static void catalog_sync_list(const char *storage_dir, const char *prefix, const char *after, long limit) {
+    changes_sync(storage_dir);
+    size_t plen = strlen(prefix);
+    long live = 0;
+    char *from = NULL;
+    for (;;) {
+        char *batch[SYNC_BATCH];
+        size_t n = 0;
+        pthread_rwlock_rdlock(&catalog.lock);
+        meta_entry_t *e = from ? skip_seek(from, false)
+                               : (after[0] && strcmp(after, prefix) >= 0) ? skip_seek(after, false)
+                                                                          : skip_seek(prefix, true);
+        for (; e && strncmp(e->name, prefix, plen) == 0 && n < SYNC_BATCH &&
+               (limit <= 0 || live + (long)n <= limit); e = e->fwd[0]) {
+            if (!(batch[n] = strdup(e->name))) break;
+            n++;
+        }
+        pthread_rwlock_unlock(&catalog.lock);
+        if (!n) break;
+        for (size_t i = 0; i < n; i++) live += catalog_sync(storage_dir, batch[i]);
+        free(from);
+        from = batch[n - 1];
+        for (size_t i = 0; i + 1 < n; i++) free(batch[i]);
+        if (limit > 0 && live > limit) break;
+    }
+    free(from);
+}
+
+// LIST [prefix] [start_after] [limit]   ("-" leaves prefix/start_after empty)
+// Replies "OK <n>", n FILE lines in name order, then "END", or "NEXT <name>"
+// when the limit cut the listing short: pass <name> as start_after to resume.
+// Each page is formatted under the catalog read lock, so it is a consistent
+// snapshot, and goes out in large writes from the reply buffer.
+static int handle_list(conn_t *c, const char *prefix, const char *after, long limit) {
+    size_t plen = strlen(prefix);
+    if (catalog.shared) catalog_sync_list(c->storage_dir, prefix, after, limit);
+    pthread_rwlock_rdlock(&catalog.lock);
+    meta_entry_t *first = (after[0] && strcmp(after, prefix) >= 0) ? skip_seek(after, false)
+                                                                 : skip_seek(prefix, true);
+    long n = 0;
+    meta_entry_t *e = first;
+    for (; e && strncmp(e->name, prefix, plen) == 0 && (limit <= 0 || n < limit); e = e->fwd[0]) n++;
+    bool more = e && strncmp(e->name, prefix, plen) == 0;
+
+    conn_reply(c, "OK %ld\n", n);
+    meta_entry_t *last = NULL;
+    for (e = first; n-- > 0; e = e->fwd[0]) {
+        if (e->crc >= 0) conn_reply(c, "FILE %s %lld %08llx\n", e->name, e->size, e->crc);
+        else conn_reply(c, "FILE %s %lld\n", e->name, e->size);
+        last = e;
+    }
+    if (more && last) conn_reply(c, "NEXT %s\n", last->name);
+    else conn_reply(c, "END\n");
+    pthread_rwlock_unlock(&catalog.lock);
+    return 0;
+}
+
+// STAT <name>: "OK <size> <mtime> <crc>", crc "-" when unknown.
+static int handle_stat(conn_t *c, const char *name) {
+    catalog_sync(c->storage_dir, name);
+    pthread_rwlock_rdlock(&catalog.lock);
+    meta_entry_t *e = catalog_find(name);
+    if (!e) conn_reply(c, "ERR not found\n");
+    else if (e->crc >= 0) conn_reply(c, "OK %lld %lld %08llx\n", e->size, (long long)e->mtime, e->crc);
+    else conn_reply(c, "OK %lld %lld -\n", e->size, (long long)e->mtime);
+    pthread_rwlock_unlock(&catalog.lock);
+    return e ? 0 : -1;
+}
+
+// HAVE <name> <size> <crc>: lets a client skip uploading content the server
+// already holds under that name. "OK HAVE" only on a size and CRC32C match.
+static int handle_have(conn_t *c, const char *name, long long size, unsigned int crc) {
+    catalog_sync(c->storage_dir, name); // another server may have replaced it
+    pthread_rwlock_rdlock(&catalog.lock);
+    meta_entry_t *e = catalog_find(name);
+    bool have = e && e->size == size && e->crc == (long long)crc;
+    pthread_rwlock_unlock(&catalog.lock);
+    conn_reply(c, have ? "OK HAVE\n" : "OK MISSING\n");
+    return 0;
+}
+
+// VERSIONS <name>: "OK <n>" and n x "VERSION <id> <size> <mtime> <crc|->",
+// oldest first, for the kept versions (the live object is STAT's).
+static int handle_versions(conn_t *c, const char *name) {
+    char path[MAX_PATH];
+    if (!object_path(path, sizeof(path), c->storage_dir, name)) {
+        conn_reply(c, "ERR bad filename\n");
+        return -1;
+    }
+    size_t n, shown = 0;
+    unsigned long long *ids = version_ids(name, &n);
+    char *lines = (char *)malloc(n * 96 + 1);
+    size_t len = 0;
+    for (size_t i = 0; lines && i < n; i++) {
+        struct stat st;
+        int fd = version_path(path, sizeof(path), name, ids[i]) ? open(path, O_RDONLY) : -1;
+        if (fd < 0) continue; // pruned meanwhile
+        if (fstat(fd, &st) == 0) {
+            long long size = object_size(fd, &st), crc = crc_xattr_get(NULL, fd);
+            len += (size_t)snprintf(lines + len, 96, "VERSION %llu %lld %lld ", ids[i], size, (long long)st.st_mtime);
+            len += (size_t)(crc >= 0 ? snprintf(lines + len, 16, "%08llx\n", crc) : snprintf(lines + len, 16, "-\n"));
+            shown++;
+        }
+        close(fd);
+    }
+    free(ids);
+    if (n && !lines) {
+        conn_reply(c, "ERR out of memory\n");
+        return -1;
+    }
+    conn_reply(c, "OK %zu\n", shown);
+    if (len) conn_write(c, lines, len);
+    free(lines);
+    return 0;
+}
+
+static void tmp_name(char *out, size_t cap, const char *storage_dir) {
+    static unsigned long seq;
+    unsigned long n = __atomic_add_fetch(&seq, 1, __ATOMIC_RELAXED);
+    snprintf(out, cap, "%s/" META_DIR "/tmp/up-%ld-%lu", storage_dir, (long)getpid(), n);
+}
+
+// O_TMPFILE where the filesystem supports it, else a uniquely named file under
+// META_DIR/tmp (its path goes to tmp; tmp is "" for an O_TMPFILE).
+static int upload_open_tmp(const char *storage_dir, char *tmp, size_t cap) {
+    tmp[0] = '\0';
+    int fd = open(storage_dir, O_TMPFILE | O_RDWR, 0644);
+    if (fd >= 0) return fd;
+    tmp_name(tmp, cap, storage_dir);
+    fd = open(tmp, O_RDWR | O_CREAT | O_EXCL, 0644);
+    if (fd < 0) tmp[0] = '\0';
+    return fd;
+}
+
+// Atomically make the finished upload the object `path`. An O_TMPFILE is first
+// given a temporary name with linkat() (which cannot replace an existing name),
+// then renamed over the live object.
+static int upload_publish(conn_t *c, const char *path) {
+    char tmp[MAX_PATH];
+    if (c->tmp[0]) {
+        snprintf(tmp, sizeof(tmp), "%s", c->tmp);
+    } else {
+        char proc[64];
+        snprintf(proc, sizeof(proc), "/proc/self/fd/%d", c->file_fd);
+        tmp_name(tmp, sizeof(tmp), c->storage_dir);
+        if (linkat(AT_FDCWD, proc, AT_FDCWD, tmp, AT_SYMLINK_FOLLOW) < 0) return -1;
+    }
+    if (object_replace(tmp, path, c->name) < 0) {
+        unlink(tmp);
+        return -1;
+    }
+    c->tmp[0] = '\0';
+    return 0;
+}
+
+static int handle_upload(conn_t *c, char *filename, long long size, long long want_crc, bool zwire) {
+    if (size < 0) {
+        conn_reply(c, "ERR invalid size\n");
+        return -1;
+    }
+    if (!conn_set_zwire(c, zwire)) {
+        conn_reply(c, "ERR out of memory\n");
+        return -1;
+    }
+    char path[MAX_PATH];
+    if (!object_path(path, sizeof(path), c->storage_dir, filename)) {
+        conn_reply(c, "ERR bad filename\n");
+        return -1;
+    }
+    // The body goes to an anonymous file; DOWNLOADs keep seeing the previous
+    // version until upload_publish() swaps the name over in one step. With
+    // --dedup it is chunked as it arrives and only the manifest is a file.
+    int fd = -1;
+    if (dedup) {
+        c->ck = chunker_new();
+        if (!c->ck) {
+            conn_reply(c, "ERR out of memory\n");
+            return -1;
+        }
+    } else {
+        fd = upload_open_tmp(c->storage_dir, c->tmp, sizeof(c->tmp));
+        if (fd < 0) {
+            conn_reply(c, "ERR cannot open file for write\n");
+            return -1;
+        }
+        if (compress_at_rest && !(c->pk = packer_new(fd, size))) {
+            close(fd);
+            if (c->tmp[0]) unlink(c->tmp);
+            c->tmp[0] = '\0';
+            conn_reply(c, "ERR out of memory\n");
+            return -1;
+        }
+    }
+
+    conn_reply(c, "OK\n"); // tell client to start sending bytes
+    c->file_fd = fd;
+    c->file_off = 0;
+    c->remaining = size;
+    c->crc = 0;
+    c->crc_inline = true;
+    c->want_crc = want_crc;
+    snprintf(c->name, sizeof(c->name), "%s", filename);
+    c->state = CONN_UPLOAD;
+    return 0;
+}
+
+// A failed body leaves the rest of it in flight, so the connection can't be
+// resynchronised: report the error and close.
+static int upload_abort(conn_t *c, const char *msg) {
+    upload_discard(c);
+    conn_reply(c, "%s", msg);
+    c->state = CONN_CLOSING;
+    return IO_DONE;
+}
+
+// Socket -> file through the ring: each io_uring_enter() writes the chunk just
+// received while already receiving the next one into the other buffer.
+// Returns NULL on success or the error reply.
+static const char *uring_upload(conn_t *c) {
+    uring_t *u = c->ring;
+    const char *err = NULL;
+    int res[2];
+    int cur = 0;
+    if (uring_set_file(u, URING_FILE_SLOT, c->file_fd) < 0) return "ERR write failed\n";
+    size_t want = (c->remaining > (long long)IO_BUF) ? IO_BUF : (size_t)c->remaining;
+    uring_prep(u, IORING_OP_READ_FIXED, URING_SOCK_SLOT, cur, want, 0, 0, 0);
+    if (uring_submit_wait(u, res) < 0) err = "ERR recv data failed\n";
+    while (!err) {
+        int n = res[0];
+        if (n <= 0) { err = "ERR recv data failed\n"; break; }
+        c->crc = crc32c(c->crc, u->bufs + (size_t)cur * IO_BUF, (size_t)n);
+        c->remaining -= n;
+        uring_prep(u, IORING_OP_WRITE_FIXED, URING_FILE_SLOT, cur, (size_t)n, c->file_off, 0, 1);
+        bool more = c->remaining > 0;
+        if (more) {
+            want = (c->remaining > (long long)IO_BUF) ? IO_BUF : (size_t)c->remaining;
+            uring_prep(u, IORING_OP_READ_FIXED, URING_SOCK_SLOT, cur ^ 1, want, 0, 0, 0);
+        }
+        if (uring_submit_wait(u, res) < 0 || res[1] != n) { err = "ERR write failed\n"; break; }
+        c->file_off += n;
+        if (!more) break;
+        cur ^= 1;
+    }
+    uring_set_file(u, URING_FILE_SLOT, -1); // drop the ring's reference to the file
+    return err;
+}
+
+// File -> socket: up to URING_BUFS linked read/write pairs per io_uring_enter().
+static int uring_download(conn_t *c) {
+    uring_t *u = c->ring;
+    int res[2 * URING_BUFS];
+    size_t lens[URING_BUFS];
+    int rc = IO_DONE;
+    if (uring_set_file(u, URING_FILE_SLOT, c->file_fd) < 0) return IO_ERR;
+    while (rc == IO_DONE && c->file_off < c->file_size) {
+        off_t off = c->file_off;
+        int pairs = 0;
+        for (; pairs < URING_BUFS && off < c->file_size; pairs++) {
+            size_t len = (c->file_size - off > (off_t)IO_BUF) ? IO_BUF : (size_t)(c->file_size - off);
+            bool last = (pairs + 1 == URING_BUFS) || (off + (off_t)len >= c->file_size);
+            uring_prep(u, IORING_OP_READ_FIXED, URING_FILE_SLOT, pairs, len, off,
+                       IOSQE_IO_LINK, (uint64_t)(2 * pairs));
+            uring_prep(u, IORING_OP_WRITE_FIXED, URING_SOCK_SLOT, pairs, len, 0,
+                       last ? 0 : IOSQE_IO_LINK, (uint64_t)(2 * pairs + 1));
+            lens[pairs] = len;
+            off += (off_t)len;
+        }
+        if (uring_submit_wait(u, res) < 0) rc = IO_ERR;
+        for (int i = 0; i < pairs && rc == IO_DONE; i++) {
+            if (res[2 * i] != (int)lens[i] || res[2 * i + 1] < 0) { rc = IO_ERR; break; }
+            size_t sent = (size_t)res[2 * i + 1];
+            if (sent < lens[i]) {
+                // A short socket write breaks the link chain: finish this buffer
+                // by hand and resubmit from the next one.
+                const char *p = u->bufs + (size_t)i * IO_BUF;
+                while (sent < lens[i]) {
+                    ssize_t n = send(c->fd, p + sent, lens[i] - sent, 0);
+                    if (n < 0 && errno == EINTR) continue;
+                    if (n <= 0) { rc = IO_ERR; break; }
+                    sent += (size_t)n;
+                }
+                c->file_off += (off_t)lens[i];
+                break;
+            }
+            c->file_off += (off_t)lens[i];
+        }
+    }
+    uring_set_file(u, URING_FILE_SLOT, -1);
+    return rc;
+}
+
+// Body written and durable (per --fsync): publish it and acknowledge.
+static int upload_finish(conn_t *c) {
+    char path[MAX_PATH];
+    struct stat st;
+    if (c->needle.vol >= 0) {
+        needle_commit(c->storage_dir, c->name, &c->needle);
+        c->needle.vol = -1;
+        conn_reply(c, "OK SAVED\n");
+        c->state = CONN_CMD;
+        return IO_DONE;
+    }
+    if (!object_path(path, sizeof(path), c->storage_dir, c->name)) {
+        return upload_abort(c, "ERR publish failed\n");
+    }
+    // Held across the catalog update so concurrent uploads of one name leave
+    // the catalog agreeing with whichever version landed last.
+    name_lock_t nl;
+    name_lock(&nl, c->name, NULL, true);
+    if (upload_publish(c, path) < 0) {
+        name_unlock(&nl);
+        return upload_abort(c, "ERR publish failed\n");
+    }
+    needle_retire(c->name, true, true);
+    if (fstat(c->file_fd, &st) == 0) {
+        long long size = c->ck ? c->ck->man.size : c->pk ? c->pk->size : (long long)st.st_size;
+        catalog_put(c->name, size, st.st_mtime, c->crc);
+    }
+    name_unlock(&nl);
+    changes_note(c->name);
+    chunker_free(c->ck, false); // its references now belong to the manifest
+    c->ck = NULL;
+    packer_free(c->pk);
+    c->pk = NULL;
+    conn_release_file(c);
+    conn_reply(c, "OK SAVED\n");
+    c->state = CONN_CMD;
+    return IO_DONE;
+}
+
+// With --dedup (and for any plain body that would read as a manifest) turn
+// the complete body into stored chunks plus a manifest in a new temp file,
+// which then replaces file_fd.
+static bool upload_chunk(conn_t *c) {
+    if (!c->ck) {
+        if (!dedup && (compress_at_rest || !(fd_is_manifest(c->file_fd) || fd_is_packed(c->file_fd)))) {
+            return true;
+        }
+        c->ck = chunker_new();
+        if (!c->ck) return false;
+        off_t off = 0;
+        ssize_t n;
+        while ((n = pread(c->file_fd, c->scratch, IO_BUF, off)) > 0) {
+            if (!chunker_feed(c->ck, c->scratch, (size_t)n)) return false;
+            off += n;
+        }
+        if (n < 0) return false;
+        conn_release_file(c); // the flat copy is no longer needed
+        if (c->tmp[0]) unlink(c->tmp);
+        c->tmp[0] = '\0';
+    }
+    if (!chunker_finish(c->ck)) return false;
+    c->file_fd = upload_open_tmp(c->storage_dir, c->tmp, sizeof(c->tmp));
+    return c->file_fd >= 0 && manifest_write(c->file_fd, &c->ck->man);
+}
+
+// --compress: complete the packed object. A body that arrived flat (a
+// committed session) is packed into a new temp file first.
+static bool upload_pack(conn_t *c) {
+    if (!compress_at_rest || c->ck) return true;
+    if (!c->pk) {
+        struct stat st;
+        char tmp[MAX_PATH];
+        if (fstat(c->file_fd, &st) < 0) return false;
+        int fd = upload_open_tmp(c->storage_dir, tmp, sizeof(tmp));
+        if (fd < 0) return false;
+        c->pk = packer_new(fd, (long long)st.st_size);
+        bool ok = c->pk != NULL;
+        off_t off = 0;
+        ssize_t n = 0;
+        while (ok && (n = pread(c->file_fd, c->scratch, IO_BUF, off)) > 0) {
+            ok = packer_feed(c->pk, c->scratch, (size_t)n);
+            off += n;
+        }
+        if (!ok || n < 0) {
+            close(fd);
+            if (tmp[0]) unlink(tmp);
+            return false;
+        }
+        conn_release_file(c); // the flat copy is no longer needed
+        if (c->tmp[0]) unlink(c->tmp);
+        c->file_fd = fd;
+        memcpy(c->tmp, tmp, sizeof(tmp));
+    }
+    return packer_finish(c->pk);
+}
+
+static bool upload_write(conn_t *c, const void *buf, size_t n) {
+    c->crc = crc32c(c->crc, buf, n);
+    if (c->ck) return chunker_feed(c->ck, buf, n);
+    if (c->pk) return packer_feed(c->pk, buf, n);
+    return write(c->file_fd, buf, n) == (ssize_t)n;
+}
+
+// --small-max: the body becomes a needle; durable per --fsync like a file.
+static int upload_needle(conn_t *c, ssize_t size) {
+    if (pread(c->file_fd, c->scratch, (size_t)size, 0) != size) return upload_abort(c, "ERR read failed\n");
+    upload_discard(c); // the temp file (or session) is done with
+    c->needle = (needle_t){ -1, 0, size, c->crc, time(NULL) };
+    if (!volume_append(c->name, 0, c->scratch, &c->needle)) {
+        c->needle.vol = -1;
+        return upload_abort(c, "ERR write failed\n");
+    }
+    int fd = volumes.v[c->needle.vol].fd; // pinned by the pending needle
+    if (fsync_mode == FSYNC_GROUP) {
+        c->sync_ticket = group_commit_submit(fd, false);
+        c->state = CONN_SYNC;
+        return IO_DONE;
+    }
+    if (fsync_mode == FSYNC_ALWAYS) fdatasync(fd);
+    return upload_finish(c);
+}
+
+// Make the complete body durable per --fsync, then publish it.
+static int upload_complete(conn_t *c) {
+    if (!c->crc_inline) {
+        // Spliced or sent in parts: checksum the file, mostly from page cache.
+        off_t off = 0;
+        ssize_t n;
+        c->crc = 0;
+        while ((n = pread(c->file_fd, c->scratch, IO_BUF, off)) > 0) {
+            c->crc = crc32c(c->crc, c->scratch, (size_t)n);
+            off += n;
+        }
+        if (n < 0) return upload_abort(c, "ERR read failed\n");
+    }
+    if (c->want_crc >= 0 && c->crc != (uint32_t)c->want_crc) {
+        // The whole body has been read, so the connection stays usable.
+        upload_discard(c);
+        conn_reply(c, "ERR checksum mismatch\n");
+        c->state = CONN_CMD;
+        return IO_DONE;
+    }
+    struct stat st;
+    if (volumes.small_max && !c->ck && !c->pk && fstat(c->file_fd, &st) == 0 && st.st_size <= volumes.small_max) {
+        return upload_needle(c, (ssize_t)st.st_size);
+    }
+    if (!upload_chunk(c)) return upload_abort(c, "ERR chunk store failed\n");
+    if (!upload_pack(c)) return upload_abort(c, "ERR compress failed\n");
+    crc_xattr_set(c->file_fd, c->crc);
+    bool new_chunks = c->ck && c->ck->new_chunks > 0;
+    if (fsync_mode == FSYNC_GROUP) {
+        c->sync_ticket = group_commit_submit(c->file_fd, new_chunks);
+        c->state = CONN_SYNC; // conn_drive() publishes once the batch is durable
+        return IO_DONE;
+    }
+    if (fsync_mode == FSYNC_ALWAYS) {
+        if (new_chunks) syncfs(c->file_fd); // the chunk files as well
+        else fsync(c->file_fd);
+    }
+    return upload_finish(c);
+}
+
+// UPLOAD_PART body received: report how far the session now reaches.
+static int session_part_done(conn_t *c) {
+    if (fsync_mode != FSYNC_NONE) fdatasync(c->file_fd);
+    c->session_part = false;
+    conn_release_file(c);
+    conn_reply(c, "OK RECEIVED %lld\n", (long long)c->file_off);
+    c->state = CONN_CMD;
+    return IO_DONE;
+}
+
+// Zero-copy receive for large bodies: socket -> pipe -> file with splice(), so
+// the data never passes through user space. Returns IO_DONE when the body is
+// complete or splice() is unusable here (upload_pump() then falls back to the
+// copy loop), IO_AGAIN on a drained non-blocking socket, IO_ERR on failure.
+static int upload_splice(conn_t *c) {
+    if (!__atomic_load_n(&splice_ok, __ATOMIC_RELAXED)) return IO_DONE;
+    c->crc_inline = false; // upload_complete() checksums the file instead
+    if (c->pipe_rd < 0) {
+        int p[2];
+        if (pipe2(p, O_CLOEXEC) < 0) return IO_DONE;
+        c->pipe_rd = p[0];
+        c->pipe_wr = p[1];
+    }
+    for (;;) {
+        while (c->piped > 0) {
+            ssize_t w = splice(c->pipe_rd, NULL, c->file_fd, NULL, c->piped, SPLICE_F_MOVE);
+            if (w < 0 && errno == EINTR) continue;
+            if (w <= 0) return upload_abort(c, "ERR write failed\n");
+            c->piped -= (size_t)w;
+            c->file_off += w;
+        }
+        if (c->remaining == 0) return IO_DONE;
+        size_t chunk = (c->remaining > (long long)IO_BUF) ? IO_BUF : (size_t)c->remaining;
+        ssize_t n = splice(c->fd, NULL, c->pipe_wr, NULL, chunk, SPLICE_F_MOVE);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK) return IO_AGAIN;
+            if (errno == EINVAL || errno == ENOSYS) {
+                __atomic_store_n(&splice_ok, false, __ATOMIC_RELAXED);
+                return IO_DONE;
+            }
+        }
+        if (n <= 0) return upload_abort(c, "ERR recv data failed\n");
+        c->piped = (size_t)n;
+        c->remaining -= n;
+    }
+}
+
+// Compressed body: collect each frame in zbuf (first from what arrived behind
+// the command line), then decode it into scratch and write it out.
+static int upload_pump_z(conn_t *c) {
+    while (c->remaining > 0) {
+        uint32_t hdr[2] = { 0, 0 };
+        size_t need = 8;
+        if (c->zlen >= 8) {
+            memcpy(hdr, c->zbuf, 8);
+            hdr[0] = ntohl(hdr[0]);
+            hdr[1] = ntohl(hdr[1]);
+            if (hdr[0] == 0 || hdr[0] > ZBLOCK || hdr[0] > c->remaining || hdr[1] > ZBOUND(hdr[0])) {
+                return upload_abort(c, "ERR bad frame\n");
+            }
+            need = 8 + hdr[1];
+        }
+        if (c->zlen < need) {
+            size_t buffered = rbuf_len(&c->in);
+            ssize_t n;
+            if (buffered > 0) {
+                n = (ssize_t)((buffered < need - c->zlen) ? buffered : need - c->zlen);
+                memcpy(c->zbuf + c->zlen, rbuf_peek(&c->in), (size_t)n);
+                rbuf_consume(&c->in, (size_t)n);
+            } else {
+                n = recv(c->fd, c->zbuf + c->zlen, need - c->zlen, 0);
+                if (n < 0) {
+                    if (errno == EINTR) continue;
+                    if (errno == EAGAIN || errno == EWOULDBLOCK) return IO_AGAIN;
+                }
+                if (n <= 0) return upload_abort(c, "ERR recv data failed\n");
+            }
+            c->zlen += (size_t)n;
+            continue;
+        }
+        const uint8_t *raw = c->zbuf + 8;
+        if (hdr[1] != hdr[0]) {
+            long n = lz4_decompress(c->zbuf + 8, hdr[1], (uint8_t *)c->scratch, IO_BUF);
+            if (n != (long)hdr[0]) return upload_abort(c, "ERR bad frame\n");
+            raw = (const uint8_t *)c->scratch;
+        }
+        if (!upload_write(c, raw, hdr[0])) return upload_abort(c, "ERR write failed\n");
+        c->remaining -= hdr[0];
+        c->file_off += hdr[0];
+        c->zlen = 0;
+    }
+    if (c->session_part) return session_part_done(c);
+    return upload_complete(c);
+}
+
+// Move UPLOAD body bytes into the file: first whatever arrived behind the
+// command line, then straight from the socket through the scratch buffer.
+static int upload_pump(conn_t *c) {
+    if (c->zwire) return upload_pump_z(c);
+    size_t buffered = rbuf_len(&c->in);
+    if (buffered > 0 && c->remaining > 0) {
+        size_t n = ((long long)buffered > c->remaining) ? (size_t)c->remaining : buffered;
+        if (!upload_write(c, rbuf_peek(&c->in), n)) return upload_abort(c, "ERR write failed\n");
+        rbuf_consume(&c->in, n);
+        c->remaining -= (long long)n;
+        c->file_off += (off_t)n;
+    }
+    if (c->ring && !c->ck && !c->pk && c->remaining > 0) {
+        const char *err = uring_upload(c);
+        if (err) return upload_abort(c, err);
+    }
+    if (!c->ck && !c->pk && (c->remaining >= SPLICE_MIN || c->pipe_rd >= 0)) {
+        int r = upload_splice(c);
+        if (r != IO_DONE) return r;
+    }
+    while (c->remaining > 0) {
+        size_t chunk = (c->remaining > (long long)IO_BUF) ? IO_BUF : (size_t)c->remaining;
+        ssize_t n = recv(c->fd, c->scratch, chunk, 0);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK) return IO_AGAIN;
+        }
+        if (n <= 0) return upload_abort(c, "ERR recv data failed\n");
+        if (!upload_write(c, c->scratch, (size_t)n)) return upload_abort(c, "ERR write failed\n");
+        c->remaining -= n;
+        c->file_off += n;
+    }
+    if (c->session_part) return session_part_done(c);
+    return upload_complete(c);
+}
+
+static bool session_id_ok(const char *id) {
+    size_t n = strlen(id);
+    if (n != SESSION_ID_LEN) return false;
+    for (size_t i = 0; i < n; i++) {
+        if (!((id[i] >= '0' && id[i] <= '9') || (id[i] >= 'a' && id[i] <= 'f'))) return false;
+    }
+    return true;
+}
+
+static void session_path(char *out, size_t cap, const char *storage_dir, const char *id, const char *suffix) {
+    snprintf(out, cap, "%s/" META_DIR "/sessions/%s%s", storage_dir, id, suffix);
+}
+
+// Opens session `id` for writing and flock()s it with `lock` (LOCK_SH for
+// parts, which may run in parallel; LOCK_EX to commit or abort; 0 for none).
+// Fills the target size and name from its .info. Replies and returns -1 on error.
+static int session_open(conn_t *c, const char *id, int lock, long long *size, char *name, size_t name_cap) {
+    char path[MAX_PATH], fmt[32];
+    if (!session_id_ok(id)) {
+        conn_reply(c, "ERR no such session\n");
+        return -1;
+    }
+    session_path(path, sizeof(path), c->storage_dir, id, ".info");
+    FILE *f = fopen(path, "r");
+    snprintf(fmt, sizeof(fmt), "%%lld %%%zus", name_cap - 1);
+    bool ok = f && fscanf(f, fmt, size, name) == 2;
+    if (f) fclose(f);
+    if (!ok) {
+        conn_reply(c, "ERR no such session\n");
+        return -1;
+    }
+    session_path(path, sizeof(path), c->storage_dir, id, "");
+    int fd = open(path, O_RDWR);
+    if (fd < 0) {
+        conn_reply(c, "ERR no such session\n");
+        return -1;
+    }
+    if (lock && flock(fd, lock | LOCK_NB) < 0) {
+        close(fd);
+        conn_reply(c, "ERR session busy\n");
+        return -1;
+    }
+    return fd;
+}
+
+// Session data arrives as parts that each write forward from their offset, so
+// while every part starts within what is already there the data is gap-free
+// and its size says how much arrived. A part starting past the end may leave a
+// gap if another part fails: that marks the session (<id>.gaps), whose COMMIT
+// then needs the CRC to prove it whole.
+static bool session_note_gap(conn_t *c, const char *id, int fd, long long offset) {
+    struct stat st;
+    if (fstat(fd, &st) == 0 && offset <= (long long)st.st_size) return true;
+    char path[MAX_PATH];
+    session_path(path, sizeof(path), c->storage_dir, id, ".gaps");
+    int m = open(path, O_WRONLY | O_CREAT, 0644);
+    if (m < 0) return false;
+    close(m);
+    return true;
+}
+
+// UPLOAD_BEGIN <name> <size>: "OK <id>" for UPLOAD_PART / UPLOAD_COMMIT.
+static int handle_upload_begin(conn_t *c, char *filename, long long size) {
+    char path[MAX_PATH], id[SESSION_ID_LEN + 1];
+    if (size < 0) {
+        conn_reply(c, "ERR invalid size\n");
+        return -1;
+    }
+    if (!object_path(path, sizeof(path), c->storage_dir, filename)) {
+        conn_reply(c, "ERR bad filename\n");
+        return -1;
+    }
+    int fd = -1;
+    for (int tries = 0; fd < 0 && tries < 8; tries++) {
+        uint64_t r;
+        if (getrandom(&r, sizeof(r), 0) != (ssize_t)sizeof(r)) {
+            r = ((uint64_t)time(NULL) << 32) ^ ((uint64_t)getpid() << 16) ^ (uint64_t)(uintptr_t)c ^ (uint64_t)tries;
+        }
+        snprintf(id, sizeof(id), "%016llx", (unsigned long long)r);
+        session_path(path, sizeof(path), c->storage_dir, id, "");
+        fd = open(path, O_WRONLY | O_CREAT | O_EXCL, 0644);
+    }
+    if (fd < 0) {
+        conn_reply(c, "ERR cannot create session\n");
+        return -1;
+    }
+    close(fd);
+    session_path(path, sizeof(path), c->storage_dir, id, ".info");
+    FILE *f = fopen(path, "w");
+    bool ok = f && fprintf(f, "%lld %s\n", size, filename) > 0;
+    if (f && fclose(f) != 0) ok = false;
+    if (!ok) {
+        unlink(path);
+        session_path(path, sizeof(path), c->storage_dir, id, "");
+        unlink(path);
+        conn_reply(c, "ERR cannot create session\n");
+        return -1;
+    }
+    conn_reply(c, "OK %s\n", id);
+    return 0;
+}
+
+// UPLOAD_PART <id> <offset> <length>: like UPLOAD, "OK" then the body, which
+// is written at offset; replies "OK RECEIVED <offset + length>". Parts may
+// arrive in any order and over several connections at once (parallel
+// uploads); UPLOAD_STATUS's received count is only a resume point for
+// clients that send their parts in order, and out-of-order parts make COMMIT
+// require the crc.
+static int handle_upload_part(conn_t *c, char *id, long long offset, long long length, bool zwire) {
+    long long size;
+    if (!conn_set_zwire(c, zwire)) {
+        conn_reply(c, "ERR out of memory\n");
+        return -1;
+    }
+    int fd = session_open(c, id, LOCK_SH, &size, c->name, sizeof(c->name));
+    if (fd < 0) return -1;
+    struct stat st;
+    if (fstat(fd, &st) < 0) {
+        close(fd);
+        conn_reply(c, "ERR read failed\n");
+        return -1;
+    }
+    if (offset < 0 || offset > size || length < 0 || length > size - offset) {
+        close(fd);
+        conn_reply(c, "ERR bad range, received %lld\n", (long long)st.st_size);
+        return -1;
+    }
+    if (!session_note_gap(c, id, fd, offset) || lseek(fd, (off_t)offset, SEEK_SET) < 0) {
+        close(fd);
+        conn_reply(c, "ERR write failed\n");
+        return -1;
+    }
+    conn_reply(c, "OK\n");
+    c->file_fd = fd;
+    c->file_off = (off_t)offset;
+    c->remaining = length;
+    c->session_part = true;
+    c->state = CONN_UPLOAD;
+    return 0;
+}
+
+// UPLOAD_STATUS <id>: "OK <received> <size>" so a client can resume.
+static int handle_upload_status(conn_t *c, char *id) {
+    long long size;
+    char name[MAX_PATH];
+    int fd = session_open(c, id, 0, &size, name, sizeof(name));
+    if (fd < 0) return -1;
+    struct stat st;
+    long long received = (fstat(fd, &st) == 0) ? (long long)st.st_size : 0;
+    close(fd);
+    conn_reply(c, "OK %lld %lld\n", received, size);
+    return 0;
+}
+
+// UPLOAD_COMMIT <id> [crc]: publish a fully received session like a finished
+// UPLOAD; with crc, only if the assembled file has that CRC32C. The crc is
+// required once parts arrived out of order (see session_note_gap()).
+static int handle_upload_commit(conn_t *c, char *id, long long want_crc) {
+    long long size;
+    int fd = session_open(c, id, LOCK_EX, &size, c->name, sizeof(c->name));
+    if (fd < 0) return -1;
+    struct stat st;
+    char path[MAX_PATH];
+    session_path(path, sizeof(path), c->storage_dir, id, ".gaps");
+    if (fstat(fd, &st) < 0 || (long long)st.st_size != size) {
+        close(fd);
+        conn_reply(c, "ERR incomplete\n");
+        return -1;
+    }
+    if (want_crc < 0 && access(path, F_OK) == 0) {
+        close(fd);
+        conn_reply(c, "ERR crc required, parts arrived out of order\n");
+        return -1;
+    }
+    unlink(path);
+    session_path(path, sizeof(path), c->storage_dir, id, ".info");
+    unlink(path);
+    session_path(c->tmp, sizeof(c->tmp), c->storage_dir, id, "");
+    c->file_fd = fd;
+    c->file_off = st.st_size;
+    c->crc_inline = false;
+    c->want_crc = want_crc;
+    return upload_complete(c);
+}
+
+// UPLOAD_ABORT <id>: drop the session and everything received for it.
+static int handle_upload_abort(conn_t *c, char *id) {
+    long long size;
+    char name[MAX_PATH], path[MAX_PATH];
+    int fd = session_open(c, id, LOCK_EX, &size, name, sizeof(name));
+    if (fd < 0) return -1;
+    session_path(path, sizeof(path), c->storage_dir, id, ".gaps");
+    unlink(path);
+    session_path(path, sizeof(path), c->storage_dir, id, ".info");
+    unlink(path);
+    session_path(path, sizeof(path), c->storage_dir, id, "");
+    unlink(path);
+    close(fd);
+    conn_reply(c, "OK ABORTED\n");
+    return 0;
+}
+
+// Delta uploads (rsync style). SIGNATURE <name> describes the stored version
+// block by block: "OK <size> <block> <n>" and n lines "<weak><crc>" of the
+// rolling checksum and CRC32C of each block (the last may be short). A client
+// holding a modified copy finds the blocks it still has and builds the new
+// version in an upload session: UPLOAD_COPY for ranges of the old version,
+// UPLOAD_PART for the rest, then UPLOAD_COMMIT <id> <crc> so a false block
+// match can't publish a corrupt file.
+#define DELTA_BLOCK_MIN 2048
+
+// An object's contents, flat or chunked, for random reads.
+typedef struct {
+    int fd;                     // flat or packed object, or the open chunk of man
+    manifest_t *man;
+    packed_t *packed;
+    size_t chunk_idx;
+    long long size;
+    long long base;             // where a needle's data starts in fd
+} object_reader_t;
+
+static bool object_open(object_reader_t *o, const char *storage_dir, const char *name) {
+    char path[MAX_PATH];
+    struct stat st;
+    if (!object_path(path, sizeof(path), storage_dir, name)) return false;
+    needle_t nd;
+    o->base = 0;
+    o->fd = needle_open(name, &nd);
+    if (o->fd >= 0) {
+        o->man = NULL;
+        o->packed = NULL;
+        o->size = nd.size;
+        o->base = nd.off;
+        return true;
+    }
+    o->fd = object_open_read(path, name, 0, -1, &o->man);
+    if (o->fd < 0 || fstat(o->fd, &st) < 0 || !S_ISREG(st.st_mode)) {
+        if (o->fd >= 0) close(o->fd);
+        if (o->man) chunk_release(o->man);
+        manifest_free(o->man);
+        return false;
+    }
+    o->packed = o->man ? NULL : packed_read(o->fd);
+    o->size = o->man ? o->man->size : o->packed ? o->packed->size : (long long)st.st_size;
+    o->chunk_idx = 0;
+    if (o->man) {
+        close(o->fd);
+        o->fd = -1;
+    }
+    return true;
 }
 
-static void chomp(char *s) {
-    size_t n = strlen(s);
-    while (n && (s[n-1] == '\n' || s[n-1] == '\r')) {
-        s[--n] = 0;
-    }
+static void object_close(object_reader_t *o) {
+    if (o->fd >= 0) close(o->fd);
+    if (o->man) chunk_release(o->man);
+    manifest_free(o->man);
+    packed_free(o->packed);
 }
 
-static bool path_join(char *out, size_t cap, const char *dir, const char *name) {
-    // Reject traversal
-    if (strstr(name, "..") != NULL || strchr(name, '/') != NULL || strchr(name, '\\') != NULL) {
-        return false;
+// Like pread(); reads stop at chunk boundaries.
+static ssize_t object_pread(object_reader_t *o, char *buf, size_t n, long long off) {
+    if (o->packed) return packed_pread(o->packed, buf, n, off);
+    if (!o->man && off >= o->size) return 0;
+    if (!o->man) return pread(o->fd, buf, ((long long)n < o->size - off) ? n : (size_t)(o->size - off), (off_t)(o->base + off));
+    manifest_t *m = o->man;
+    if (off >= m->size) return 0;
+    size_t i = o->chunk_idx;
+    if (off < m->chunks[i].off || off >= m->chunks[i].off + m->chunks[i].len) {
+        size_t lo = 0, hi = m->n;
+        while (hi - lo > 1) {
+            size_t mid = (lo + hi) / 2;
+            if (m->chunks[mid].off <= off) lo = mid;
+            else hi = mid;
+        }
+        i = lo;
     }
-    int r = snprintf(out, cap, "%s/%s", dir, name);
-    return (r > 0 && (size_t)r < cap);
+    if (i != o->chunk_idx || o->fd < 0) {
+        char path[MAX_PATH];
+        if (o->fd >= 0) close(o->fd);
+        chunk_path(path, sizeof(path), m->chunks[i].digest);
+        o->fd = open(path, O_RDONLY);
+        o->chunk_idx = i;
+        if (o->fd < 0) return -1;
+    }
+    long long left = m->chunks[i].off + m->chunks[i].len - off;
+    return pread(o->fd, buf, ((long long)n < left) ? n : (size_t)left, (off_t)(off - m->chunks[i].off));
 }
 
-static int lock_fd(int fd, short type) {
-    struct flock fl;
-    memset(&fl, 0, sizeof(fl));
-    fl.l_type = type;   // F_RDLCK or F_WRLCK
-    fl.l_whence = SEEK_SET;
-    fl.l_start = 0;
-    fl.l_len = 0;       // lock whole file
-    return fcntl(fd, F_SETLKW, &fl);
+// rsync's rolling checksum: two 16-bit sums, the second weighted by position.
+static uint32_t weak_sum(const uint8_t *p, size_t n) {
+    uint32_t a = 0, b = 0;
+    for (size_t i = 0; i < n; i++) {
+        a += p[i];
+        b += (uint32_t)(n - i) * p[i];
+    }
+    return (a & 0xffff) | (b << 16);
 }
 
-static int unlock_fd(int fd) {
-    struct flock fl;
-    memset(&fl, 0, sizeof(fl));
-    fl.l_type = F_UNLCK;
-    fl.l_whence = SEEK_SET;
-    fl.l_start = 0;
-    fl.l_len = 0;
-    return fcntl(fd, F_SETLK, &fl);
+// Around sqrt(size), like rsync, so the signature grows with the square root
+// of the object; capped at one scratch buffer.
+static long long delta_block(long long size) {
+    long long b = DELTA_BLOCK_MIN;
+    while (b < IO_BUF && b * b < size) b *= 2;
+    return b;
 }
 
-static int handle_list(int cfd, const char *storage_dir) {
-    DIR *d = opendir(storage_dir);
-    if (!d) {
-        send_line(cfd, "ERR cannot open storage\n");
+static int handle_signature(conn_t *c, char *filename) {
+    object_reader_t o;
+    if (!object_open(&o, c->storage_dir, filename)) {
+        conn_reply(c, "ERR not found\n");
         return -1;
     }
-    // Count items
-    int count = 0;
-    struct dirent *de;
-    while ((de = readdir(d)) != NULL) {
-        if (strcmp(de->d_name, ".") && strcmp(de->d_name, "..")) count++;
-    }
-    rewinddir(d);
-    send_line(cfd, "OK %d\n", count);
-
-    while ((de = readdir(d)) != NULL) {
-        if (!strcmp(de->d_name, ".") || !strcmp(de->d_name, "..")) continue;
-        char path[MAX_PATH];
-        if (!path_join(path, sizeof(path), storage_dir, de->d_name)) continue;
-        struct stat st;
-        if (stat(path, &st) == 0 && S_ISREG(st.st_mode)) {
-            send_line(cfd, "FILE %s %lld\n", de->d_name, (long long)st.st_size);
+    long long block = delta_block(o.size);
+    long long n = (o.size + block - 1) / block;
+    size_t mark = c->out_len;
+    conn_reply(c, "OK %lld %lld %lld\n", o.size, block, n);
+    for (long long off = 0; off < o.size; off += block) {
+        size_t len = (o.size - off < block) ? (size_t)(o.size - off) : (size_t)block;
+        size_t got = 0;
+        while (got < len) {
+            ssize_t r = object_pread(&o, c->scratch + got, len - got, off + (long long)got);
+            if (r <= 0) break;
+            got += (size_t)r;
+        }
+        if (got < len) {
+            c->out_len = mark; // drop the partial reply
+            object_close(&o);
+            conn_reply(c, "ERR read failed\n");
+            return -1;
         }
+        conn_reply(c, "%08x%08x\n", weak_sum((const uint8_t *)c->scratch, len), crc32c(0, c->scratch, len));
     }
-    send_line(cfd, "END\n");
-    closedir(d);
+    object_close(&o);
     return 0;
 }
 
-static int handle_upload(int cfd, const char *storage_dir, char *filename, long long size) {
-    if (size < 0) {
-        send_line(cfd, "ERR invalid size\n");
+// UPLOAD_COPY <id> <offset> <length> <src_offset>: fill session bytes
+// [offset, offset + length) from the stored version of the session's target
+// at src_offset. Replies "OK RECEIVED <offset + length>" like a part.
+static int handle_upload_copy(conn_t *c, char *id, long long offset, long long length, long long src) {
+    long long size;
+    char name[MAX_PATH];
+    int fd = session_open(c, id, LOCK_SH, &size, name, sizeof(name));
+    if (fd < 0) return -1;
+    object_reader_t o;
+    if (!object_open(&o, c->storage_dir, name)) {
+        close(fd);
+        conn_reply(c, "ERR not found\n");
         return -1;
     }
-    char path[MAX_PATH];
-    if (!path_join(path, sizeof(path), storage_dir, filename)) {
-        send_line(cfd, "ERR bad filename\n");
+    if (offset < 0 || length < 0 || offset > size || length > size - offset ||
+        src < 0 || src > o.size || length > o.size - src) {
+        object_close(&o);
+        close(fd);
+        conn_reply(c, "ERR bad range\n");
         return -1;
     }
-    // Open with O_CREAT|O_TRUNC
-    int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
-    if (fd < 0) {
-        send_line(cfd, "ERR cannot open file for write\n");
-        return -1;
+    const char *err = session_note_gap(c, id, fd, offset) ? NULL : "ERR write failed\n";
+    long long done = 0;
+    while (!err && done < length) {
+        ssize_t n = -1;
+        if (!o.man && !o.packed) {
+            // In-kernel copy (a reflink where the filesystem can); falls
+            // through to the read/write loop where it isn't supported.
+            loff_t in = (loff_t)(o.base + src + done), out = (loff_t)(offset + done);
+            n = copy_file_range(o.fd, &in, fd, &out, (size_t)(length - done), 0);
+            if (n > 0) { done += n; continue; }
+        }
+        size_t want = (length - done > IO_BUF) ? IO_BUF : (size_t)(length - done);
+        n = object_pread(&o, c->scratch, want, src + done);
+        if (n <= 0) err = "ERR read failed\n";
+        else if (pwrite(fd, c->scratch, (size_t)n, (off_t)(offset + done)) != n) err = "ERR write failed\n";
+        else done += n;
     }
-    // Exclusive write lock during upload
-    if (lock_fd(fd, F_WRLCK) < 0) {
-        close(fd);
-        send_line(cfd, "ERR cannot lock file\n");
+    object_close(&o);
+    if (!err && fsync_mode != FSYNC_NONE) fdatasync(fd);
+    close(fd);
+    if (err) {
+        conn_reply(c, "%s", err);
         return -1;
     }
+    conn_reply(c, "OK RECEIVED %lld\n", offset + length);
+    return 0;
+}
 
-    send_line(cfd, "OK\n"); // tell client to start sending bytes
+static void download_ok(conn_t *c, long long n, long long crc) {
+    if (c->zwire && crc >= 0) conn_reply(c, "OK %lld %08llx lz4\n", n, crc);
+    else if (c->zwire) conn_reply(c, "OK %lld - lz4\n", n);
+    else if (crc >= 0) conn_reply(c, "OK %lld %08llx\n", n, crc);
+    else conn_reply(c, "OK %lld\n", n);
+}
 
-    const size_t BUF = 1 << 16;
-    char *buf = (char *)malloc(BUF);
-    if (!buf) {
-        unlock_fd(fd); close(fd);
-        send_line(cfd, "ERR server oom\n");
+// A needle is served from the volume holding it, fd, like a file that
+// starts at its offset.
+static int download_needle(conn_t *c, int fd, const needle_t *n, long long offset, long long length) {
+    if (offset < 0 || offset > n->size || length < -1) {
+        close(fd);
+        conn_reply(c, "ERR bad range\n");
         return -1;
     }
-    long long remaining = size;
-    while (remaining > 0) {
-        size_t chunk = (remaining > (long long)BUF) ? BUF : (size_t)remaining;
-        ssize_t n = recv_all(cfd, buf, chunk);
-        if (n <= 0) {
-            free(buf);
-            unlock_fd(fd); close(fd);
-            send_line(cfd, "ERR recv data failed\n");
-            return -1;
-        }
-        ssize_t w = write(fd, buf, (size_t)n);
-        if (w != n) {
-            free(buf);
-            unlock_fd(fd); close(fd);
-            send_line(cfd, "ERR write failed\n");
-            return -1;
-        }
-        remaining -= n;
-    }
-    free(buf);
-    fsync(fd);
-    unlock_fd(fd);
-    close(fd);
-    send_line(cfd, "OK SAVED\n");
+    long long end = (length < 0 || length > n->size - offset) ? n->size : offset + length;
+    download_ok(c, end - offset, n->crc);
+    c->file_fd = fd;
+    c->file_off = (off_t)(n->off + offset);
+    c->file_size = (off_t)(n->off + end);
+    c->state = CONN_DOWNLOAD;
     return 0;
 }
 
-static int handle_download(int cfd, const char *storage_dir, char *filename) {
-    char path[MAX_PATH];
-    if (!path_join(path, sizeof(path), storage_dir, filename)) {
-        send_line(cfd, "ERR bad filename\n");
+// DOWNLOAD <name> [offset [length]]: streams bytes [offset, offset + length)
+// (to EOF when length is omitted), so an interrupted transfer can resume.
+// <name>@<id> reads a kept version when no object has that literal name.
+static int handle_download(conn_t *c, char *filename, long long offset, long long length, bool zwire) {
+    char path[MAX_PATH], base[MAX_PATH];
+    unsigned long long id;
+    if (!conn_set_zwire(c, zwire)) {
+        conn_reply(c, "ERR out of memory\n");
         return -1;
     }
-    int fd = open(path, O_RDONLY);
-    if (fd < 0) {
-        send_line(cfd, "ERR not found\n");
+    if (!object_path(path, sizeof(path), c->storage_dir, filename)) {
+        conn_reply(c, "ERR bad filename\n");
         return -1;
     }
-    // Shared read lock
-    if (lock_fd(fd, F_RDLCK) < 0) {
-        close(fd);
-        send_line(cfd, "ERR cannot lock file\n");
+    needle_t nd;
+    int nfd = needle_open(filename, &nd);
+    if (nfd >= 0) return download_needle(c, nfd, &nd, offset, length);
+    // Lock-free: this descriptor (or the pinned chunks) keeps reading one
+    // complete version while uploads publish new ones under the name.
+    manifest_t *m = NULL;
+    int fd = object_open_read(path, filename, offset, length, &m);
+    if (fd < 0 && errno == ENOENT && version_split(filename, base, sizeof(base), &id) &&
+        version_path(path, sizeof(path), base, id)) {
+        fd = object_open_read(path, base, offset, length, &m);
+    }
+    if (fd < 0) {
+        conn_reply(c, "ERR not found\n");
         return -1;
     }
     struct stat st;
-    if (fstat(fd, &st) < 0) {
-        unlock_fd(fd); close(fd);
-        send_line(cfd, "ERR stat failed\n");
+    const char *err = NULL;
+    if (fstat(fd, &st) < 0) err = "ERR stat failed\n";
+    else if (!S_ISREG(st.st_mode)) err = "ERR not a file\n";
+    packed_t *pk = (err || m) ? NULL : packed_read(fd);
+    long long size = m ? m->size : pk ? pk->size : (long long)st.st_size;
+    long long crc = err ? -1 : crc_xattr_get(NULL, fd);
+    if (!err && (offset < 0 || offset > size || length < -1)) err = "ERR bad range\n";
+    if (err || m) close(fd);
+    if (err) {
+        if (m) chunk_release(m);
+        manifest_free(m);
+        packed_free(pk);
+        conn_reply(c, "%s", err);
         return -1;
     }
-    if (!S_ISREG(st.st_mode)) {
-        unlock_fd(fd); close(fd);
-        send_line(cfd, "ERR not a file\n");
-        return -1;
+    long long end = (length < 0 || length > size - offset) ? size : offset + length;
+    download_ok(c, end - offset, crc);
+    c->file_fd = m ? -1 : fd;
+    c->man = m;
+    c->packed = pk;
+    c->chunk_idx = 0;
+    if (m) {
+        // Last chunk starting at or before offset.
+        size_t lo = 0, hi = m->n;
+        while (hi - lo > 1) {
+            size_t mid = (lo + hi) / 2;
+            if (m->chunks[mid].off <= offset) lo = mid;
+            else hi = mid;
+        }
+        c->chunk_idx = lo;
+    }
+    c->file_off = (off_t)offset;
+    c->file_size = (off_t)end;
+    c->state = CONN_DOWNLOAD;
+    return 0;
+}
+
+// Chunked object: sendfile() from each chunk file in turn.
+static int manifest_pump(conn_t *c) {
+    manifest_t *m = c->man;
+    while (c->file_off < c->file_size) {
+        chunk_ref_t *r = &m->chunks[c->chunk_idx];
+        if (c->file_off >= r->off + (off_t)r->len) {
+            if (c->chunk_fd >= 0) close(c->chunk_fd);
+            c->chunk_fd = -1;
+            c->chunk_idx++;
+            continue;
+        }
+        if (c->chunk_fd < 0) {
+            char path[MAX_PATH];
+            chunk_path(path, sizeof(path), r->digest);
+            c->chunk_fd = open(path, O_RDONLY);
+            if (c->chunk_fd < 0) {
+                conn_release_file(c);
+                return IO_ERR;
+            }
+        }
+        off_t coff = c->file_off - r->off;
+        off_t stop = (r->off + (off_t)r->len < c->file_size) ? r->off + (off_t)r->len : c->file_size;
+        ssize_t n = sendfile(c->fd, c->chunk_fd, &coff, (size_t)(stop - c->file_off));
+        if (n < 0 && errno == EINTR) continue;
+        if (n < 0 && errno == EAGAIN) return IO_AGAIN;
+        if (n <= 0) { // send error, or the chunk is shorter than the manifest says
+            conn_release_file(c);
+            return IO_ERR;
+        }
+        c->file_off += n;
+    }
+    conn_release_file(c);
+    c->state = CONN_CMD;
+    return IO_DONE;
+}
+
+// Reads up to n bytes of the object being downloaded at file_off, from
+// file_fd, the chunk files of man, or the blocks of packed.
+static ssize_t download_read(conn_t *c, char *buf, size_t n) {
+    if (c->packed) return packed_pread(c->packed, buf, n, c->file_off);
+    if (!c->man) return pread(c->file_fd, buf, n, c->file_off);
+    chunk_ref_t *r = &c->man->chunks[c->chunk_idx];
+    while (c->file_off >= r->off + (off_t)r->len) {
+        if (c->chunk_fd >= 0) close(c->chunk_fd);
+        c->chunk_fd = -1;
+        r = &c->man->chunks[++c->chunk_idx];
+    }
+    if (c->chunk_fd < 0) {
+        char path[MAX_PATH];
+        chunk_path(path, sizeof(path), r->digest);
+        c->chunk_fd = open(path, O_RDONLY);
+        if (c->chunk_fd < 0) return -1;
+    }
+    off_t left = r->off + (off_t)r->len - c->file_off;
+    return pread(c->chunk_fd, buf, ((off_t)n < left) ? n : (size_t)left, c->file_off - r->off);
+}
+
+// Downloads that can't use sendfile(): LZ4 framed (zwire) and/or read from a
+// packed object. One ZBLOCK at a time goes through the reply buffer, the next
+// only once the previous one is out. A block-aligned frame of a packed object
+// goes out as stored, without decompressing and compressing it again.
+static int download_pump_buffered(conn_t *c) {
+    while (c->file_off < c->file_size) {
+        int r = conn_flush(c);
+        if (r != IO_DONE) return r;
+        size_t want = (c->file_size - c->file_off > ZBLOCK) ? ZBLOCK : (size_t)(c->file_size - c->file_off);
+        if (c->zwire && c->packed && c->file_off % PACK_BLOCK == 0) {
+            size_t i = (size_t)(c->file_off / PACK_BLOCK);
+            size_t stored = (size_t)(c->packed->off[i + 1] - c->packed->off[i]);
+            if (want == packed_raw_len(c->packed, i)) {
+                uint32_t hdr[2] = { htonl((uint32_t)want), htonl((uint32_t)stored) };
+                memcpy(c->zbuf, hdr, 8);
+                if (pread(c->file_fd, c->zbuf + 8, stored, (off_t)c->packed->off[i]) != (ssize_t)stored ||
+                    conn_write(c, c->zbuf, 8 + stored) < 0) {
+                    conn_release_file(c);
+                    return IO_ERR;
+                }
+                c->file_off += (off_t)want;
+                continue;
+            }
+        }
+        size_t got = 0;
+        while (got < want) {
+            ssize_t n = download_read(c, c->scratch + got, want - got);
+            if (n <= 0) { // the file is shorter than it was
+                conn_release_file(c);
+                return IO_ERR;
+            }
+            got += (size_t)n;
+            c->file_off += n;
+        }
+        r = c->zwire ? conn_write(c, c->zbuf, zframe_pack(c->scratch, want, c->zbuf))
+                     : conn_write(c, c->scratch, want);
+        if (r < 0) {
+            conn_release_file(c);
+            return IO_ERR;
+        }
     }
-    long long size = (long long)st.st_size;
-    send_line(cfd, "OK %lld\n", size);
+    conn_release_file(c);
+    c->state = CONN_CMD;
+    return IO_DONE;
+}
 
-    off_t offset = 0;
-#ifdef __linux__
+static int download_pump(conn_t *c) {
+    if (c->zwire || c->packed) return download_pump_buffered(c);
+    if (c->man) return manifest_pump(c);
+    if (c->ring) {
+        int r = uring_download(c);
+        conn_release_file(c);
+        if (r != IO_DONE) return IO_ERR;
+        c->state = CONN_CMD;
+        return IO_DONE;
+    }
     // sendfile from file->socket is efficient on Linux
-    while (offset < st.st_size) {
-        ssize_t n = sendfile(cfd, fd, &offset, (size_t)(st.st_size - offset));
+    while (c->file_off < c->file_size) {
+        ssize_t n = sendfile(c->fd, c->file_fd, &c->file_off, (size_t)(c->file_size - c->file_off));
         if (n < 0) {
             if (errno == EINTR) continue;
-            unlock_fd(fd); close(fd);
-            return -1;
+            if (errno == EAGAIN) return IO_AGAIN;
+            conn_release_file(c);
+            return IO_ERR;
         }
         if (n == 0) break;
     }
-#else
-    // Fallback copy
-    const size_t BUF = 1 << 16;
-    char *buf = malloc(BUF);
-    if (!buf) { unlock_fd(fd); close(fd); return -1; }
-    ssize_t n;
-    while ((n = read(fd, buf, BUF)) > 0) {
-        if (send_all(cfd, buf, (size_t)n) != n) { free(buf); unlock_fd(fd); close(fd); return -1; }
-    }
-    free(buf);
-#endif
-    unlock_fd(fd);
-    close(fd);
-    return 0;
+    conn_release_file(c);
+    c->state = CONN_CMD;
+    return IO_DONE;
 }
 
-static int handle_rename(int cfd, const char *storage_dir, char *oldn, char *newn) {
+static int handle_rename(conn_t *c, char *oldn, char *newn) {
     char oldp[MAX_PATH], newp[MAX_PATH];
-    if (!path_join(oldp, sizeof(oldp), storage_dir, oldn) ||
-        !path_join(newp, sizeof(newp), storage_dir, newn)) {
-        send_line(cfd, "ERR bad filename\n");
-        return -1;
-    }
-    // Lock the old file for write to prevent clashes
-    int fd = open(oldp, O_RDWR);
-    if (fd < 0) {
-        send_line(cfd, "ERR not found\n");
+    if (!object_path(oldp, sizeof(oldp), c->storage_dir, oldn) ||
+        !object_path(newp, sizeof(newp), c->storage_dir, newn)) {
+        conn_reply(c, "ERR bad filename\n");
         return -1;
     }
-    if (lock_fd(fd, F_WRLCK) < 0) {
-        close(fd);
-        send_line(cfd, "ERR cannot lock\n");
-        return -1;
+    name_lock_t nl;
+    name_lock(&nl, oldn, newn, true);
+    needle_t nd;
+    bool needle = needle_get(oldn, &nd);
+    int r = needle ? needle_rename(oldn, newn, newp) : object_replace(oldp, newp, newn);
+    int err = errno;
+    if (r == 0 && !needle) {
+        needle_retire(newn, true, true);
+        catalog_rename(oldn, newn);
     }
-    int r = rename(oldp, newp);
-    unlock_fd(fd);
-    close(fd);
+    name_unlock(&nl);
+    if (r == 0) changes_note(newn);
     if (r < 0) {
-        send_line(cfd, "ERR rename failed\n");
+        conn_reply(c, err == ENOENT ? "ERR not found\n" : "ERR rename failed\n");
         return -1;
     }
-    send_line(cfd, "OK RENAMED\n");
+    conn_reply(c, "OK RENAMED\n");
     return 0;
 }
 
-static int handle_delete(int cfd, const char *storage_dir, char *filename) {
+static int handle_delete(conn_t *c, char *filename) {
     char path[MAX_PATH];
-    if (!path_join(path, sizeof(path), storage_dir, filename)) {
-        send_line(cfd, "ERR bad filename\n");
+    if (!object_path(path, sizeof(path), c->storage_dir, filename)) {
+        conn_reply(c, "ERR bad filename\n");
         return -1;
     }
-    // Lock file for write before delete (best effort)
-    int fd = open(path, O_RDWR);
-    if (fd >= 0) {
-        if (lock_fd(fd, F_WRLCK) == 0) {
-            // proceed
-        }
-    }
-    int r = unlink(path);
-    if (fd >= 0) {
-        if (fd >= 0) unlock_fd(fd);
-        close(fd);
+    name_lock_t nl;
+    name_lock(&nl, filename, NULL, true);
+    needle_t nd;
+    int r = needle_get(filename, &nd) ? 0 : object_replace(NULL, path, filename);
+    if (r == 0) {
+        needle_retire(filename, true, true);
+        catalog_remove(filename);
     }
+    name_unlock(&nl);
     if (r < 0) {
-        send_line(cfd, "ERR delete failed\n");
+        conn_reply(c, "ERR delete failed\n");
         return -1;
     }
-    send_line(cfd, "OK DELETED\n");
+    conn_reply(c, "OK DELETED\n");
     return 0;
 }
 
-static void *client_thread(void *arg) {
-    client_ctx_t ctx = *(client_ctx_t *)arg;
-    free(arg);
-
-    int cfd = ctx.client_fd;
-    char line[MAX_LINE];
-
-    send_line(cfd, "OK WELCOME\n");
+static void conn_dispatch(conn_t *c, char *line) {
+    chomp(line);
+    if (line[0] == '\0') return;
 
-    for (;;) {
-        ssize_t n = recv_line(cfd, line, sizeof(line));
-        if (n <= 0) break;
-        chomp(line);
-        if (line[0] == '\0') continue;
-
-        // Parse
-        char cmd[32], a1[MAX_PATH], a2[MAX_PATH];
-        long long size = -1;
-        memset(cmd, 0, sizeof(cmd));
-        memset(a1, 0, sizeof(a1));
-        memset(a2, 0, sizeof(a2));
+    // Parse
+    char a1[MAX_PATH], a2[MAX_PATH], opt[16] = "", opt2[16] = "";
+    long long size = -1;
+    memset(a1, 0, sizeof(a1));
+    memset(a2, 0, sizeof(a2));
 
-        if (sscanf(line, "LIST") == 0 && strncmp(line, "LIST", 4) == 0) {
-            handle_list(cfd, ctx.storage_dir);
+    if (strncmp(line, "LIST", 4) == 0 && (line[4] == '\0' || line[4] == ' ')) {
+        long limit = 0;
+        int n = sscanf(line, "LIST %1023s %1023s %ld", a1, a2, &limit);
+        if (n < 1 || strcmp(a1, "-") == 0) a1[0] = '\0';
+        if (n < 2 || strcmp(a2, "-") == 0) a2[0] = '\0';
+        handle_list(c, a1, a2, limit);
+    }
+    else if (sscanf(line, "UPLOAD_BEGIN %1023s %lld", a1, &size) == 2) {
+        handle_upload_begin(c, a1, size);
+    }
+    else if (strncmp(line, "UPLOAD_PART ", 12) == 0) {
+        long long offset = -1, length = -1;
+        if (sscanf(line, "UPLOAD_PART %1023s %lld %lld %15s", a1, &offset, &length, opt) >= 3) {
+            handle_upload_part(c, a1, offset, length, strcmp(opt, "lz4") == 0);
+        } else {
+            conn_reply(c, "ERR usage: UPLOAD_PART <id> <offset> <length>\n");
         }
-        else if (sscanf(line, "UPLOAD %1023s %lld", a1, &size) == 2) {
-            handle_upload(cfd, ctx.storage_dir, a1, size);
+    }
+    else if (sscanf(line, "UPLOAD_STATUS %1023s", a1) == 1) {
+        handle_upload_status(c, a1);
+    }
+    else if (sscanf(line, "UPLOAD_COMMIT %1023s", a1) == 1) {
+        unsigned int crc;
+        handle_upload_commit(c, a1, sscanf(line, "UPLOAD_COMMIT %*s %x", &crc) == 1 ? (long long)crc : -1);
+    }
+    else if (strncmp(line, "UPLOAD_COPY ", 12) == 0) {
+        long long offset = -1, length = -1, src = -1;
+        if (sscanf(line, "UPLOAD_COPY %1023s %lld %lld %lld", a1, &offset, &length, &src) == 4) {
+            handle_upload_copy(c, a1, offset, length, src);
+        } else {
+            conn_reply(c, "ERR usage: UPLOAD_COPY <id> <offset> <length> <src_offset>\n");
         }
-        else if (sscanf(line, "DOWNLOAD %1023s", a1) == 1) {
-            handle_download(cfd, ctx.storage_dir, a1);
+    }
+    else if (sscanf(line, "SIGNATURE %1023s", a1) == 1) {
+        handle_signature(c, a1);
+    }
+    else if (sscanf(line, "UPLOAD_ABORT %1023s", a1) == 1) {
+        handle_upload_abort(c, a1);
+    }
+    else if (sscanf(line, "UPLOAD %1023s %lld", a1, &size) == 2) {
+        unsigned int crc;
+        sscanf(line, "UPLOAD %*s %*d %15s %15s", opt, opt2);
+        bool has_crc = strcmp(opt, "-") != 0 && sscanf(opt, "%x", &crc) == 1;
+        handle_upload(c, a1, size, has_crc ? (long long)crc : -1, strcmp(opt2, "lz4") == 0);
+    }
+    else if (sscanf(line, "DOWNLOAD %1023s", a1) == 1) {
+        long long offset = 0, length = -1;
+        sscanf(line, "DOWNLOAD %*s %lld %lld %15s", &offset, &length, opt);
+        handle_download(c, a1, offset, length, strcmp(opt, "lz4") == 0);
+    }
+    else if (sscanf(line, "STAT %1023s", a1) == 1) {
+        handle_stat(c, a1);
+    }
+    else if (sscanf(line, "VERSIONS %1023s", a1) == 1) {
+        handle_versions(c, a1);
+    }
+    else if (strncmp(line, "HAVE ", 5) == 0) {
+        unsigned int crc;
+        if (sscanf(line, "HAVE %1023s %lld %x", a1, &size, &crc) == 3) handle_have(c, a1, size, crc);
+        else conn_reply(c, "ERR usage: HAVE <filename> <size> <crc32c>\n");
+    }
+    else if (sscanf(line, "RENAME %1023s %1023s", a1, a2) == 2) {
+        handle_rename(c, a1, a2);
+    }
+    else if (sscanf(line, "DELETE %1023s", a1) == 1) {
+        handle_delete(c, a1);
+    }
+    else if (strncmp(line, "QUIT", 4) == 0) {
+        conn_reply(c, "OK BYE\n");
+        c->state = CONN_CLOSING;
+    }
+    else {
+        conn_reply(c, "ERR unknown command\n");
+    }
+}
+
+static void loop_park(conn_t *c);
+
+// Advance a connection until it needs more input or output space (IO_AGAIN)
+// or should be closed (IO_ERR). With a blocking socket it runs until close.
+static int conn_drive(conn_t *c) {
+    for (;;) {
+        int r;
+        // Replies to pipelined commands go out in one send: flush only when no
+        // further command is buffered, a body transfer is next, or enough
+        // output has piled up.
+        if (c->state != CONN_CMD || c->out_len >= IO_BUF || !rbuf_has_line(&c->in)) {
+            r = conn_flush(c);
+            if (r != IO_DONE) return r;
         }
-        else if (sscanf(line, "RENAME %1023s %1023s", a1, a2) == 2) {
-            handle_rename(cfd, ctx.storage_dir, a1, a2);
+
+        if (c->state == CONN_CLOSING) return IO_ERR;
+        if (c->state == CONN_SYNC) {
+            if (!group_commit_done(c->sync_ticket)) {
+                if (!c->loop) {
+                    group_commit_wait(c->sync_ticket);
+                } else {
+                    loop_park(c);
+                    return IO_AGAIN;
+                }
+            }
+            upload_finish(c);
+            continue;
         }
-        else if (sscanf(line, "DELETE %1023s", a1) == 1) {
-            handle_delete(cfd, ctx.storage_dir, a1);
+        if (c->state == CONN_UPLOAD || c->state == CONN_DOWNLOAD) {
+            r = (c->state == CONN_UPLOAD) ? upload_pump(c) : download_pump(c);
+            if (r != IO_DONE) return r;
+            continue;
         }
-        else if (strncmp(line, "QUIT", 4) == 0) {
-            send_line(cfd, "OK BYE\n");
-            break;
+
+        char line[MAX_LINE];
+        if (rbuf_getline(&c->in, line, sizeof(line)) > 0) {
+            conn_dispatch(c, line);
+            continue;
         }
-        else {
-            send_line(cfd, "ERR unknown command\n");
+        if (rbuf_full(&c->in)) {
+            conn_reply(c, "ERR line too long\n");
+            c->state = CONN_CLOSING;
+            continue;
         }
+        ssize_t n = rbuf_fill(&c->in, c->fd);
+        if (n < 0) return (errno == EAGAIN || errno == EWOULDBLOCK) ? IO_AGAIN : IO_ERR;
+        if (n == 0) return IO_ERR; // peer closed
     }
-
-    close(cfd);
-    return NULL;
 }
 
-int main(int argc, char **argv) {
-    if (argc < 2) {
-        fprintf(stderr, "Usage: %s <port> [storage_dir]\n", argv[0]);
-        return 1;
-    }
-    int port = atoi(argv[1]);
-    const char *storage_dir = (argc >= 3) ? argv[2] : "storage";
-
-    // Ensure storage dir exists
-    if (mkdir(storage_dir, 0755) < 0 && errno != EEXIST) {
-        die("Failed to create storage dir: %s", storage_dir);
-    }
-
-    signal(SIGINT, on_sigint);
-
+static int open_listener(int port, bool reuseport) {
     int sfd = socket(AF_INET, SOCK_STREAM, 0);
     if (sfd < 0) die("socket failed");
 
     int yes = 1;
     setsockopt(sfd, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof(yes));
+    if (reuseport && setsockopt(sfd, SOL_SOCKET, SO_REUSEPORT, &yes, sizeof(yes)) < 0) {
+        die("SO_REUSEPORT not supported");
+    }
 
     struct sockaddr_in addr;
     memset(&addr, 0, sizeof(addr));
@@ -437,8 +4131,79 @@ int main(int argc, char **argv) {
 
     if (bind(sfd, (struct sockaddr *)&addr, sizeof(addr)) < 0) die("bind failed");
     if (listen(sfd, BACKLOG) < 0) die("listen failed");
+    return sfd;
+}
 
-    printf("Server listening on port %d, storage: %s\n", port, storage_dir);
+static void serve_client(int cfd, const char *storage_dir, char *scratch, uring_t *ring) {
+    conn_t c;
+    conn_init(&c, cfd, storage_dir, scratch);
+    if (ring && uring_set_file(ring, URING_SOCK_SLOT, cfd) == 0) c.ring = ring;
+    conn_reply(&c, "OK WELCOME lz4\n");
+    // Blocking socket: conn_drive() only returns once the client is done.
+    conn_drive(&c);
+    conn_destroy(&c);
+    if (c.ring) uring_set_file(ring, URING_SOCK_SLOT, -1);
+}
+
+static int queue_pop(work_queue_t *q) {
+    pthread_mutex_lock(&q->mu);
+    while (q->count == 0) pthread_cond_wait(&q->not_empty, &q->mu);
+    int fd = q->fds[q->head];
+    q->head = (q->head + 1) % q->cap;
+    q->count--;
+    q->active++;
+    pthread_mutex_unlock(&q->mu);
+    return fd;
+}
+
+static void queue_done(work_queue_t *q) {
+    pthread_mutex_lock(&q->mu);
+    q->active--;
+    pthread_mutex_unlock(&q->mu);
+}
+
+// Returns false when active + queued connections already reach max_conns.
+static bool queue_push(work_queue_t *q, int fd) {
+    pthread_mutex_lock(&q->mu);
+    bool ok = q->active + q->count < max_conns;
+    if (ok) {
+        q->fds[(q->head + q->count) % q->cap] = fd;
+        q->count++;
+        pthread_cond_signal(&q->not_empty);
+    }
+    pthread_mutex_unlock(&q->mu);
+    return ok;
+}
+
+static void *worker_thread(void *arg) {
+    work_queue_t *q = (work_queue_t *)arg;
+    char *scratch = (char *)malloc(IO_BUF);
+    if (!scratch) die("out of memory");
+    // Falls back to plain syscalls for this worker if the ring can't be set up.
+    uring_t *ring = (engine == ENGINE_URING) ? uring_open() : NULL;
+    for (;;) {
+        int cfd = queue_pop(q);
+        serve_client(cfd, q->storage_dir, scratch, ring);
+        queue_done(q);
+    }
+    return NULL;
+}
+
+static void run_threads(int sfd, const char *storage_dir, int nworkers) {
+    static work_queue_t q;
+    if (max_conns <= 0) max_conns = 4 * nworkers;
+    if (max_conns < nworkers) max_conns = nworkers;
+    q.cap = max_conns;
+    q.fds = (int *)malloc(sizeof(int) * (size_t)q.cap);
+    if (!q.fds) die("out of memory");
+    q.storage_dir = storage_dir;
+    pthread_mutex_init(&q.mu, NULL);
+    pthread_cond_init(&q.not_empty, NULL);
+    for (int i = 0; i < nworkers; i++) {
+        pthread_t th;
+        if (pthread_create(&th, NULL, worker_thread, &q) != 0) die("pthread_create failed");
+        pthread_detach(th);
+    }
 
     while (running) {
         struct sockaddr_in cli;
@@ -449,23 +4214,335 @@ int main(int argc, char **argv) {
             perror("accept");
             break;
         }
-        client_ctx_t *ctx = (client_ctx_t *)malloc(sizeof(client_ctx_t));
-        ctx->client_fd = cfd;
-        strncpy(ctx->storage_dir, storage_dir, sizeof(ctx->storage_dir)-1);
-        ctx->storage_dir[sizeof(ctx->storage_dir)-1] = '\0';
+        if (!queue_push(&q, cfd)) {
+            // Saturated: fail fast rather than let queueing delay grow unbounded.
+            send(cfd, "ERR busy\n", 9, MSG_NOSIGNAL | MSG_DONTWAIT);
+            close(cfd);
+        }
+    }
+}
 
-        pthread_t th;
-        if (pthread_create(&th, NULL, client_thread, ctx) != 0) {
-            perror("pthread_create");
+// One epoll instance per loop thread. The listening socket is registered in
+// every loop with EPOLLEXCLUSIVE so a new connection wakes a single loop,
+// which then owns that connection for its whole life.
+typedef struct event_loop {
+    int epfd;
+    int lfd;
+    int wakefd;                 // eventfd poked by the group committer
+    conn_t *parked;             // uploads waiting for their group commit
+    int cpu;                    // CPU to pin the loop thread to, -1 for none
+    const char *storage_dir;
+    char *scratch;
+} event_loop_t;
+
+static void loop_close(conn_t *c) {
+    if (c->parked) {
+        conn_t **pp = &c->loop->parked;
+        while (*pp != c) pp = &(*pp)->park_next;
+        *pp = c->park_next;
+    }
+    conn_destroy(c);
+    free(c);
+    __atomic_sub_fetch(&open_conns, 1, __ATOMIC_RELAXED);
+}
+
+// Keep an upload aside until the committer reports its batch durable.
+static void loop_park(conn_t *c) {
+    if (c->parked) return;
+    c->parked = true;
+    c->park_next = c->loop->parked;
+    c->loop->parked = c;
+}
+
+static void loop_unpark_ready(event_loop_t *lp) {
+    uint64_t v;
+    if (read(lp->wakefd, &v, sizeof(v)) < 0) { /* spurious */ }
+    conn_t *list = lp->parked;
+    lp->parked = NULL;
+    while (list) {
+        conn_t *c = list;
+        list = c->park_next;
+        c->parked = false;
+        if (!group_commit_done(c->sync_ticket)) loop_park(c);
+        else if (conn_drive(c) == IO_ERR) loop_close(c);
+    }
+}
+
+
+static void loop_accept(event_loop_t *lp) {
+    for (;;) {
+        int cfd = accept4(lp->lfd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (cfd < 0) {
+            if (errno == EINTR || errno == ECONNABORTED) continue;
+            if (errno != EAGAIN && errno != EWOULDBLOCK) perror("accept");
+            return;
+        }
+        if (max_conns > 0 && __atomic_load_n(&open_conns, __ATOMIC_RELAXED) >= max_conns) {
+            send(cfd, "ERR busy\n", 9, MSG_NOSIGNAL);
+            close(cfd);
+            continue;
+        }
+        conn_t *c = (conn_t *)malloc(sizeof(conn_t));
+        if (!c) {
             close(cfd);
-            free(ctx);
             continue;
         }
+        __atomic_add_fetch(&open_conns, 1, __ATOMIC_RELAXED);
+        conn_init(c, cfd, lp->storage_dir, lp->scratch);
+        c->loop = lp;
+        struct epoll_event ev;
+        ev.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+        ev.data.ptr = c;
+        if (epoll_ctl(lp->epfd, EPOLL_CTL_ADD, cfd, &ev) < 0) {
+            perror("epoll_ctl");
+            loop_close(c);
+            continue;
+        }
+        conn_reply(c, "OK WELCOME lz4\n");
+        if (conn_drive(c) == IO_ERR) loop_close(c);
+    }
+}
+
+static void *loop_thread(void *arg) {
+    event_loop_t *lp = (event_loop_t *)arg;
+    struct epoll_event evs[MAX_EVENTS];
+    if (lp->cpu >= 0) {
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        CPU_SET(lp->cpu, &set);
+        if (pthread_setaffinity_np(pthread_self(), sizeof(set), &set) != 0) {
+            fprintf(stderr, "could not pin event loop to CPU %d\n", lp->cpu);
+        }
+    }
+    while (running) {
+        int n = epoll_wait(lp->epfd, evs, MAX_EVENTS, 500);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            perror("epoll_wait");
+            break;
+        }
+        for (int i = 0; i < n; i++) {
+            conn_t *c = (conn_t *)evs[i].data.ptr;
+            if (!c) {
+                loop_accept(lp);
+                continue;
+            }
+            if ((void *)c == (void *)&lp->wakefd) {
+                loop_unpark_ready(lp);
+                continue;
+            }
+            // Edge-triggered: drive until the socket would block either way.
+            if (conn_drive(c) == IO_ERR) loop_close(c);
+        }
+    }
+    return NULL;
+}
+
+// With --reuseport every loop owns a separate SO_REUSEPORT listener, so the
+// kernel spreads incoming connections across loops and no accept queue is
+// shared. Otherwise all loops wait on the one listener with EPOLLEXCLUSIVE.
+static void run_epoll(int sfd, int port, const char *storage_dir, int nloops) {
+    event_loop_t *loops = (event_loop_t *)calloc((size_t)nloops, sizeof(event_loop_t));
+    gcommit.wake_fds = (int *)calloc((size_t)nloops, sizeof(int));
+    if (!loops || !gcommit.wake_fds) die("out of memory");
+    int ncpu = (int)sysconf(_SC_NPROCESSORS_ONLN);
+    for (int i = 0; i < nloops; i++) {
+        event_loop_t *lp = &loops[i];
+        lp->lfd = (reuseport && i > 0) ? open_listener(port, true) : sfd;
+        int fl = fcntl(lp->lfd, F_GETFL, 0);
+        if (fl < 0 || fcntl(lp->lfd, F_SETFL, fl | O_NONBLOCK) < 0) die("fcntl O_NONBLOCK failed");
+        lp->cpu = (pin_cpus && ncpu > 0) ? i % ncpu : -1;
+        lp->storage_dir = storage_dir;
+        lp->epfd = epoll_create1(EPOLL_CLOEXEC);
+        if (lp->epfd < 0) die("epoll_create1 failed");
+        lp->scratch = (char *)malloc(IO_BUF);
+        if (!lp->scratch) die("out of memory");
+        struct epoll_event ev;
+        ev.events = reuseport ? EPOLLIN : (EPOLLIN | EPOLLEXCLUSIVE);
+        ev.data.ptr = NULL; // marks the listener
+        if (epoll_ctl(lp->epfd, EPOLL_CTL_ADD, lp->lfd, &ev) < 0) die("epoll_ctl listener failed");
+        lp->wakefd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        if (lp->wakefd < 0) die("eventfd failed");
+        ev.events = EPOLLIN;
+        ev.data.ptr = &lp->wakefd;
+        if (epoll_ctl(lp->epfd, EPOLL_CTL_ADD, lp->wakefd, &ev) < 0) die("epoll_ctl eventfd failed");
+        gcommit.wake_fds[i] = lp->wakefd;
+    }
+    gcommit.nwake = nloops;
+    for (int i = 1; i < nloops; i++) {
+        pthread_t th;
+        if (pthread_create(&th, NULL, loop_thread, &loops[i]) != 0) die("pthread_create failed");
+        pthread_detach(th);
+    }
+    loop_thread(&loops[0]);
+}
+
+static void usage(const char *prog) {
+    fprintf(stderr, "Usage: %s <port> [storage_dir] [--engine=threads|epoll|uring] [--loops N]\n"
+                    "       [--reuseport] [--pin] [--workers N] [--max-conns M]\n"
+                    "       [--fsync=always|group|none] [--fsync-window-us N] [--dedup | --compress]\n"
+                    "       [--shared-dir] [--versions N] [--version-days D] [--small-max N]\n"
+                    "       %s --bench-crc\n", prog, prog);
+}
+
+// Accepts "--name=value" and "--name value"; returns NULL if argv[*i] is not --name.
+static const char *opt_value(int argc, char **argv, int *i, const char *name) {
+    size_t n = strlen(name);
+    if (strncmp(argv[*i], name, n) != 0) return NULL;
+    if (argv[*i][n] == '=') return argv[*i] + n + 1;
+    if (argv[*i][n] == '\0' && *i + 1 < argc) return argv[++*i];
+    return NULL;
+}
+
+int main(int argc, char **argv) {
+    int port = -1;
+    const char *storage_dir = "storage";
+    int nloops = (int)sysconf(_SC_NPROCESSORS_ONLN);
+    int nworkers = DEFAULT_WORKERS;
+    int npos = 0;
+    bool shared_dir = false;
+
+    for (int i = 1; i < argc; i++) {
+        const char *v;
+        if ((v = opt_value(argc, argv, &i, "--engine")) != NULL) {
+            if (strcmp(v, "threads") == 0) engine = ENGINE_THREADS;
+            else if (strcmp(v, "epoll") == 0) engine = ENGINE_EPOLL;
+            else if (strcmp(v, "uring") == 0) engine = ENGINE_URING;
+            else die("Unknown engine: %s", v);
+        }
+        else if ((v = opt_value(argc, argv, &i, "--loops")) != NULL) {
+            nloops = atoi(v);
+        }
+        else if (strcmp(argv[i], "--reuseport") == 0) {
+            reuseport = true;
+        }
+        else if (strcmp(argv[i], "--pin") == 0) {
+            pin_cpus = true;
+        }
+        else if ((v = opt_value(argc, argv, &i, "--fsync")) != NULL) {
+            if (strcmp(v, "always") == 0) fsync_mode = FSYNC_ALWAYS;
+            else if (strcmp(v, "group") == 0) fsync_mode = FSYNC_GROUP;
+            else if (strcmp(v, "none") == 0) fsync_mode = FSYNC_NONE;
+            else die("Unknown fsync mode: %s", v);
+        }
+        else if ((v = opt_value(argc, argv, &i, "--fsync-window-us")) != NULL) {
+            fsync_window_us = atol(v);
+        }
+        else if (strcmp(argv[i], "--bench-crc") == 0) {
+            crc32c_init();
+            crc32c_bench();
+            return 0;
+        }
+        else if (strcmp(argv[i], "--dedup") == 0) {
+            dedup = true;
+        }
+        else if (strcmp(argv[i], "--compress") == 0) {
+            compress_at_rest = true;
+        }
+        else if (strcmp(argv[i], "--shared-dir") == 0) {
+            shared_dir = true;
+        }
+        else if ((v = opt_value(argc, argv, &i, "--versions")) != NULL) {
+            versions.keep = atoi(v);
+            versions.enabled = versions.keep > 0 || versions.days > 0;
+        }
+        else if ((v = opt_value(argc, argv, &i, "--small-max")) != NULL) {
+            volumes.small_max = atoll(v);
+        }
+        else if ((v = opt_value(argc, argv, &i, "--version-days")) != NULL) {
+            versions.days = atol(v);
+            versions.enabled = versions.keep > 0 || versions.days > 0;
+        }
+        else if ((v = opt_value(argc, argv, &i, "--workers")) != NULL) {
+            nworkers = atoi(v);
+        }
+        else if ((v = opt_value(argc, argv, &i, "--max-conns")) != NULL) {
+            max_conns = atoi(v);
+        }
+        else if (argv[i][0] == '-') {
+            usage(argv[0]);
+            return 1;
+        }
+        else if (npos++ == 0) {
+            port = atoi(argv[i]);
+        }
+        else {
+            storage_dir = argv[i];
+        }
+    }
+    if (port < 0) {
+        usage(argv[0]);
+        return 1;
+    }
+    if (nloops < 1) nloops = 1;
+    if (nworkers < 1) nworkers = 1;
+    crc32c_init();
+    if ((reuseport || pin_cpus) && engine != ENGINE_EPOLL) die("--reuseport/--pin need --engine=epoll");
+    if (dedup && compress_at_rest) die("--compress can't be combined with --dedup");
+    // Chunk reference counts live in one process's memory.
+    if (dedup && shared_dir) die("--dedup can't be combined with --shared-dir");
+    if (volumes.small_max < 0 || volumes.small_max > IO_BUF) die("--small-max must be between 0 and %d", IO_BUF);
+    // Volumes are appended by one process, and a packed or chunked body is
+    // never a needle.
+    if (volumes.small_max && (shared_dir || dedup || compress_at_rest)) {
+        die("--small-max can't be combined with --shared-dir, --dedup or --compress");
+    }
+    if (engine == ENGINE_URING) {
+        uring_t *probe = uring_open();
+        if (!probe) {
+            fprintf(stderr, "io_uring not available, falling back to threads engine\n");
+            engine = ENGINE_THREADS;
+        }
+        uring_close(probe);
+    }
+
+    // Ensure storage dir exists
+    if (mkdir(storage_dir, 0755) < 0 && errno != EEXIST) {
+        die("Failed to create storage dir: %s", storage_dir);
+    }
+    prepare_storage(storage_dir);
+    name_locks_init(storage_dir, shared_dir);
+    catalog.shared = shared_dir;
+    if (shared_dir) changes_init(storage_dir);
+    catalog_load(storage_dir);
+    volumes_load(storage_dir);
+
+    signal(SIGINT, on_sigint);
+    signal(SIGPIPE, SIG_IGN); // a vanished client must not kill the server
+
+    if (fsync_mode == FSYNC_GROUP) {
+        if (fsync_window_us < 0) fsync_window_us = 0;
+        pthread_t th;
+        if (pthread_create(&th, NULL, group_commit_thread, NULL) != 0) die("pthread_create failed");
+        pthread_detach(th);
+    }
+    if (versions.enabled) {
+        pthread_t th;
+        if (pthread_create(&th, NULL, prune_thread, NULL) != 0) die("pthread_create failed");
         pthread_detach(th);
     }
+    if (volumes.used || volumes.small_max) {
+        pthread_t th;
+        if (pthread_create(&th, NULL, compact_thread, NULL) != 0) die("pthread_create failed");
+        pthread_detach(th);
+    }
+
+    int sfd = open_listener(port, reuseport);
+
+    printf("Server listening on port %d, storage: %s\n", port, storage_dir);
+    if (engine == ENGINE_EPOLL) {
+        printf("Engine: epoll, %d event loop(s)%s%s\n", nloops,
+               reuseport ? ", SO_REUSEPORT listener per loop" : "", pin_cpus ? ", pinned" : "");
+        fflush(stdout);
+        run_epoll(sfd, port, storage_dir, nloops);
+    } else {
+        printf("Engine: %s, %d worker(s)\n",
+               (engine == ENGINE_URING) ? "threads with io_uring data path" : "threads", nworkers);
+        fflush(stdout);
+        run_threads(sfd, storage_dir, nworkers);
+    }
 
     close(sfd);
     printf("Server shutting down.\n");
     return 0;
 }
-
@@ -0,0 +1,237 @@
+#!/bin/bash
+# tests/roundtrip.sh - end-to-end round trips through ./server and ./client
+# Run by "make test". Starts the server on $PORT (default 9187) over a temp
+# directory, moves files through it and checks what comes back byte for byte.
+# Needs bash (for /dev/tcp), coreutils and timeout.
+set -u
+cd "$(dirname "$0")/.." || exit 1
+PORT=${PORT:-9187}
+TMP=$(mktemp -d)
+ST=$TMP/st
+SRV=
+fails=0
+
+fail() { echo "FAIL: $*"; fails=$((fails + 1)); }
+
+stop() {
+    [ -n "$SRV" ] || return 0
+    kill "$SRV" 2>/dev/null
+    wait "$SRV" 2>/dev/null
+    SRV=
+}
+
+trap 'stop; rm -rf "$TMP"' EXIT
+
+# start <server options...>: a server on $ST, once it accepts connections.
+start() {
+    ./server "$PORT" "$ST" "$@" >>"$TMP/server.log" 2>&1 &
+    SRV=$!
+    for _ in $(seq 50); do
+        (exec 3<>"/dev/tcp/127.0.0.1/$PORT") 2>/dev/null && return 0
+        sleep 0.1
+    done
+    fail "server $* did not start"
+    stop
+    return 1
+}
+
+# client <options...>: run the commands on stdin.
+client() {
+    timeout 120 ./client "$@" 127.0.0.1 "$PORT" >>"$TMP/client.log" 2>&1
+}
+
+# Raw protocol on fd 3: conn, then cmd "<line>" leaves the reply in $REPLY.
+conn() {
+    exec 3<>"/dev/tcp/127.0.0.1/$PORT" && read -r REPLY <&3
+}
+
+cmd() {
+    printf '%s\n' "$1" >&3
+    read -r REPLY <&3
+}
+
+# body <n>: the next n bytes of fd 3 on stdout.
+body() {
+    dd bs="$1" count=1 iflag=fullblock status=none <&3
+}
+
+# part <id> <offset> <length> <file>: UPLOAD_PART from that range of file.
+part() {
+    cmd "UPLOAD_PART $1 $2 $3"
+    [ "$REPLY" = OK ] || return 1
+    tail -c +$(($2 + 1)) "$4" | head -c "$3" >&3
+    read -r REPLY <&3
+}
+
+same() {
+    cmp -s "$1" "$2" || fail "$3: $(basename "$2") differs"
+}
+
+# check_files <label> <client options> <names...>: upload, download, compare.
+check_files() {
+    local label=$1 opts=$2 f
+    shift 2
+    for f in "$@"; do echo "upload $TMP/$f $f"; done | client $opts
+    for f in "$@"; do rm -f "$TMP/$f.out"; echo "download $f $TMP/$f.out"; done | client $opts
+    for f in "$@"; do same "$TMP/$f" "$TMP/$f.out" "$label"; done
+}
+
+head -c 1000 /dev/urandom >"$TMP/small"
+head -c $((9 << 20)) /dev/urandom >"$TMP/big"     # past the session / -j size
+yes "GET /api/v1/item status=200 bytes=4242" | head -c 3000000 >"$TMP/text"
+head -c 30000 /dev/urandom >"$TMP/sess"
+: >"$TMP/empty"
+
+# Every engine, plain, -j 4 and -z transfers.
+for engine in threads epoll uring; do
+    rm -rf "$ST"
+    start --engine=$engine || continue
+    for opts in "" "-j 4" "-z"; do
+        check_files "$engine $opts" "$opts" small big text empty
+    done
+    conn
+    cmd "RENAME small small2"
+    [ "$REPLY" = "OK RENAMED" ] || fail "$engine: RENAME: $REPLY"
+    cmd "DELETE text"
+    [ "$REPLY" = "OK DELETED" ] || fail "$engine: DELETE: $REPLY"
+    cmd "LIST"
+    names=
+    for _ in $(seq "${REPLY#OK }"); do
+        read -r _ name _ <&3
+        names="$names $name"
+    done
+    read -r REPLY <&3
+    [ "$names" = " big empty small2" ] || fail "$engine: LIST gave$names"
+    exec 3<&-
+    stop
+done
+
+# Ranged and resumed downloads.
+rm -rf "$ST"
+if start; then
+    check_files "range" "" big
+    conn
+    cmd "DOWNLOAD big 1000 5000"
+    body 5000 >"$TMP/range.out"
+    tail -c +1001 "$TMP/big" | head -c 5000 >"$TMP/range"
+    same "$TMP/range" "$TMP/range.out" "ranged DOWNLOAD"
+    exec 3<&-
+    head -c 3000000 "$TMP/big" >"$TMP/resumed.part"
+    echo "download big $TMP/resumed" | client
+    same "$TMP/big" "$TMP/resumed" "resumed download"
+    grep -q "resumed at 3000000" "$TMP/client.log" || fail "download did not resume"
+    head -c 3000 /dev/urandom >"$TMP/stale.part"     # not a prefix of big
+    echo "download big $TMP/stale" | client
+    same "$TMP/big" "$TMP/stale" "download over a stale .part"
+    stop
+fi
+
+# Upload sessions: parts in order commit as they are; parts out of order
+# leave possible gaps, so COMMIT then needs the CRC32C.
+rm -rf "$ST"
+if start; then
+    check_files "session" "" sess
+    conn
+    cmd "STAT sess"
+    crc=${REPLY##* }
+    cmd "UPLOAD_BEGIN inorder 30000"
+    id=${REPLY#OK }
+    part "$id" 0 10000 "$TMP/sess" && part "$id" 10000 20000 "$TMP/sess"
+    cmd "UPLOAD_COMMIT $id"
+    [ "$REPLY" = "OK SAVED" ] || fail "in-order COMMIT: $REPLY"
+    cmd "UPLOAD_BEGIN gaps 30000"
+    id=${REPLY#OK }
+    part "$id" 20000 10000 "$TMP/sess" && part "$id" 0 5000 "$TMP/sess"
+    cmd "UPLOAD_COMMIT $id"
+    [ "${REPLY%% *}" = ERR ] || fail "COMMIT with a gap: $REPLY"
+    part "$id" 5000 15000 "$TMP/sess"
+    cmd "UPLOAD_COMMIT $id"
+    [ "${REPLY%% *}" = ERR ] || fail "out-of-order COMMIT without crc: $REPLY"
+    cmd "UPLOAD_COMMIT $id $crc"
+    [ "$REPLY" = "OK SAVED" ] || fail "out-of-order COMMIT with crc: $REPLY"
+    exec 3<&-
+    printf 'download inorder %s\ndownload gaps %s\n' "$TMP/inorder" "$TMP/gaps" | client
+    same "$TMP/sess" "$TMP/inorder" "session"
+    same "$TMP/sess" "$TMP/gaps" "session"
+    stop
+fi
+
+# --dedup: an edited copy shares chunks, both survive a restart.
+rm -rf "$ST"
+cp "$TMP/big" "$TMP/big2"
+printf 'edited' | dd of="$TMP/big2" bs=1 seek=4000000 conv=notrunc status=none
+if start --dedup; then
+    check_files "dedup" "" big big2
+    stop
+    chunks=$(du -sb "$ST/.mcs/chunks" | cut -f1)
+    [ "$chunks" -lt $((12 << 20)) ] || fail "dedup: $chunks bytes of chunks for two near copies"
+    if start --dedup; then
+        rm -f "$TMP/big.out" "$TMP/big2.out"
+        printf 'download big %s\ndownload big2 %s\n' "$TMP/big.out" "$TMP/big2.out" | client
+        same "$TMP/big" "$TMP/big.out" "dedup after restart"
+        same "$TMP/big2" "$TMP/big2.out" "dedup after restart"
+        stop
+    fi
+fi
+
+# --compress: stored smaller, served whole and by range.
+rm -rf "$ST"
+if start --compress; then
+    check_files "compress" "" text small
+    stored=$(stat -c %s "$ST"/*/*/text)
+    [ "$stored" -lt 1000000 ] || fail "compress: text stored as $stored bytes"
+    conn
+    cmd "DOWNLOAD text 123456 70000"
+    body 70000 >"$TMP/range.out"
+    tail -c +123457 "$TMP/text" | head -c 70000 >"$TMP/range"
+    same "$TMP/range" "$TMP/range.out" "compressed ranged DOWNLOAD"
+    exec 3<&-
+    stop
+fi
+
+# --small-max: small objects become needles; once most of a volume is
+# replaced, the compactor moves the live ones and deletes it.
+rm -rf "$ST"
+mkdir -p "$TMP/n"
+if start --small-max 4096; then
+    for _ in 1 2 3 4; do
+        for i in $(seq 100); do
+            head -c 2000 /dev/urandom >"$TMP/n/o$i"
+            echo "upload $TMP/n/o$i o$i"
+        done | client
+    done
+    stop
+    before=$(du -sb "$ST/.mcs/volumes" | cut -f1)
+    # Roll over to a new (empty) active volume, as a full one would.
+    last=$(ls "$ST/.mcs/volumes" | sort | tail -1)
+    : >"$ST/.mcs/volumes/$(printf '%016x' $((16#${last%.vol} + 1))).vol"
+    if start --small-max 4096; then
+        sleep 12                                    # COMPACT_INTERVAL
+        after=$(du -sb "$ST/.mcs/volumes" | cut -f1)
+        [ "$after" -lt "$before" ] || fail "needles: volumes not compacted ($before -> $after bytes)"
+        for i in $(seq 100); do echo "download o$i $TMP/n/o$i.out"; done | client
+        for i in $(seq 100); do same "$TMP/n/o$i" "$TMP/n/o$i.out" "needles after compaction"; done
+        stop
+    fi
+fi
+
+# A flat storage directory of an older version is fanned out at startup.
+rm -rf "$ST"
+mkdir -p "$ST"
+cp "$TMP/small" "$ST/flat1"
+cp "$TMP/sess" "$ST/ab"          # named like a fan-out directory
+if start; then
+    [ -z "$(find "$ST" -maxdepth 1 -type f)" ] || fail "migration left files in the top directory"
+    [ -f "$(echo "$ST"/*/*/flat1)" ] || fail "migration: flat1 not fanned out"
+    printf 'download flat1 %s\ndownload ab %s\n' "$TMP/flat1" "$TMP/ab" | client
+    same "$TMP/small" "$TMP/flat1" "migration"
+    same "$TMP/sess" "$TMP/ab" "migration"
+    stop
+fi
+
+if [ "$fails" -ne 0 ]; then
+    echo "$fails check(s) failed; server log:"
+    tail -20 "$TMP/server.log"
+    exit 1
+fi
+echo "roundtrip: all checks passed"